@@ -0,0 +1,104 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../block.h"
+
+/*
+ * Drives the block cache without a mount. A block is dirty in the cache
+ * with old data when a bio_writev of it and a long run of uncached blocks
+ * after it starts, and a bio_flush runs while that write is under way.
+ * The flush must not leave the old data on the disk behind the cache's
+ * back: once both are done and the cache is flushed again, the disk and
+ * the cache both hold the new data.
+ */
+#define DISKFILE "bio_test.disk"
+#define BLOCKNO 1
+#define RUN 8192
+#define NBLOCKS (BLOCKNO + RUN)
+#define ROUNDS 40
+
+char old_data[BLOCK_SIZE], new_data[BLOCK_SIZE], on_disk[BLOCK_SIZE], cached[BLOCK_SIZE];
+void *bufs[RUN];
+int writing, delay_us;
+
+/* writes new_data over the run, the cached block first */
+static void *writer(void *arg) {
+	__atomic_store_n(&writing, 1, __ATOMIC_SEQ_CST);
+	bio_writev(BLOCKNO, bufs, RUN);
+	return NULL;
+}
+
+/* writes back the cache delay_us after the write has started */
+static void *flusher(void *arg) {
+	struct timespec start, now;
+
+	while (!__atomic_load_n(&writing, __ATOMIC_SEQ_CST))
+		;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	while ((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000 < delay_us);
+
+	bio_flush();
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+
+	int i, fd;
+
+	unlink(DISKFILE);
+	dev_init(DISKFILE, NBLOCKS);
+	if (bio_cache_init(0) < 0) {
+		printf("could not set up the block cache \n");
+		exit(1);
+	}
+	if ((fd = open(DISKFILE, O_RDONLY)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	for (i = 0; i < RUN; i++)
+		bufs[i] = new_data;
+
+	/* TEST 1: write-through racing write-back */
+	for (i = 0; i < ROUNDS; i++) {
+		pthread_t a, b;
+		memset(old_data, 2 * i, BLOCK_SIZE);
+		memset(new_data, 2 * i + 1, BLOCK_SIZE);
+		writing = 0;
+		delay_us = i * 50;
+
+		if (bio_write(BLOCKNO, old_data) != BLOCK_SIZE) {
+			printf("TEST 1: Block I/O failure \n");
+			exit(1);
+		}
+
+		pthread_create(&a, NULL, writer, NULL);
+		pthread_create(&b, NULL, flusher, NULL);
+		pthread_join(a, NULL);
+		pthread_join(b, NULL);
+
+		if (bio_flush() < 0 || bio_read(BLOCKNO, cached) != BLOCK_SIZE ||
+		    pread(fd, on_disk, BLOCK_SIZE, (off_t) BLOCKNO * BLOCK_SIZE) != BLOCK_SIZE) {
+			printf("TEST 1: Block I/O failure \n");
+			exit(1);
+		}
+		if (memcmp(cached, new_data, BLOCK_SIZE) != 0 || memcmp(on_disk, new_data, BLOCK_SIZE) != 0) {
+			printf("TEST 1: Stale block %s after round %d \n",
+				memcmp(cached, new_data, BLOCK_SIZE) != 0 ? "in the cache" : "on disk", i);
+			exit(1);
+		}
+	}
+	printf("TEST 1: Write-through racing write-back success \n");
+
+	close(fd);
+	dev_close();
+	unlink(DISKFILE);
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * Mounts rufs itself with -o csum=data, so run it from this directory
+ * with nothing mounted on TESTDIR. The image is DISKFILE here.
+ */
+#define TESTDIR "/tmp/ttd31/mountdir"
+#define RUFS "../rufs"
+#define DISKFILE "DISKFILE"
+
+#define BLOCKSIZE 4096
+#define ITERS 16
+#define FILEPERM 0666
+
+char buf[ITERS*BLOCKSIZE], pattern[ITERS*BLOCKSIZE];
+
+/* Starts rufs in the foreground and waits for TESTDIR to become the mount */
+static pid_t mount_rufs(void) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		execl(RUFS, "rufs", "-f", "-o", "csum=data", TESTDIR, (char *) NULL);
+		perror("execl");
+		_exit(1);
+	}
+
+	struct stat dir, parent;
+	for (int i = 0; i < 500; i++) {
+		if (stat(TESTDIR, &dir) == 0 && stat(TESTDIR "/..", &parent) == 0 && dir.st_dev != parent.st_dev)
+			return pid;
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			break;
+		usleep(10000);
+	}
+	printf("could not mount " RUFS " on " TESTDIR "\n");
+	exit(1);
+}
+
+/* The block cache is written back as rufs exits, so wait for it */
+static void unmount_rufs(pid_t pid) {
+	if (system("fusermount -u " TESTDIR) != 0 || waitpid(pid, NULL, 0) != pid) {
+		printf("could not unmount " TESTDIR "\n");
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv) {
+
+	int i, fd;
+	pid_t pid;
+
+	for (i = 0; i < ITERS*BLOCKSIZE; i++)
+		pattern[i] = "CSUMTEST"[i % 8] ^ (i / BLOCKSIZE);
+
+	/* TEST 1: write a file on a fresh image with data checksums */
+	unlink(DISKFILE);
+	pid = mount_rufs();
+
+	if ((fd = creat(TESTDIR "/csum", FILEPERM)) < 0 ||
+	    write(fd, pattern, sizeof(pattern)) != sizeof(pattern) || close(fd) < 0) {
+		perror("write");
+		printf("TEST 1: File write failure \n");
+		exit(1);
+	}
+	unmount_rufs(pid);
+	printf("TEST 1: File write Success \n");
+
+
+	/* TEST 2: flip one bit of the file's fourth block in the image */
+	int img = open(DISKFILE, O_RDWR);
+	off_t found = -1;
+	for (off_t pos = 0; img >= 0 && pread(img, buf, BLOCKSIZE, pos) == BLOCKSIZE; pos += BLOCKSIZE) {
+		if (memcmp(buf, pattern + 3*BLOCKSIZE, BLOCKSIZE) == 0) {
+			found = pos;
+			break;
+		}
+	}
+	buf[100] ^= 1;
+	if (found < 0 || pwrite(img, buf, BLOCKSIZE, found) != BLOCKSIZE) {
+		printf("TEST 2: Image corrupt failure \n");
+		exit(1);
+	}
+	close(img);
+	printf("TEST 2: Image corrupt Success \n");
+
+
+	/* TEST 3: after a remount the corrupted block reads as EIO, the rest still reads */
+	pid = mount_rufs();
+
+	if ((fd = open(TESTDIR "/csum", O_RDONLY)) < 0) {
+		perror("open");
+		printf("TEST 3: File open failure \n");
+		exit(1);
+	}
+	errno = 0;
+	if (pread(fd, buf, BLOCKSIZE, 3*BLOCKSIZE) >= 0 || errno != EIO) {
+		printf("TEST 3: Corrupted block read did not fail with EIO \n");
+		exit(1);
+	}
+	if (pread(fd, buf, BLOCKSIZE, 0) != BLOCKSIZE || memcmp(buf, pattern, BLOCKSIZE) != 0) {
+		printf("TEST 3: Intact block read failure \n");
+		exit(1);
+	}
+	close(fd);
+	unmount_rufs(pid);
+	printf("TEST 3: Corrupted block EIO Success \n");
+
+	return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../lz.h"
+
+/* Round trips the cluster compressor, which needs no mount */
+
+#define CLUSTER (16 * 4096)
+
+unsigned char in[CLUSTER], out[CLUSTER + CLUSTER / 255 + 16], back[CLUSTER];
+
+/* Compresses len bytes of in and expands them again, -1 unless they come back the same */
+static int round_trip(int len, int *clen) {
+	*clen = lz_compress(in, len, out, sizeof(out));
+	if (*clen <= 0)
+		return -1;
+
+	memset(back, 0, sizeof(back));
+	if (lz_decompress(out, *clen, back, len) != len || memcmp(in, back, len) != 0)
+		return -1;
+
+	/* one byte less room than it expands to must be refused, not overrun */
+	if (len > 0 && lz_decompress(out, *clen, back, len - 1) != -1)
+		return -1;
+
+	return 0;
+}
+
+static void fill_random(unsigned char *p, int len, uint32_t seed) {
+	for (int i = 0; i < len; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		p[i] = seed;
+	}
+}
+
+int main(int argc, char **argv) {
+
+	int clen;
+
+	/* TEST 1: incompressible input */
+	fill_random(in, CLUSTER, 0x2545f491);
+	if (round_trip(CLUSTER, &clen) < 0) {
+		printf("TEST 1: Incompressible round trip failure \n");
+		exit(1);
+	}
+	if (lz_compress(in, CLUSTER, out, CLUSTER - 1) != 0) {
+		printf("TEST 1: Incompressible input did not report it does not fit \n");
+		exit(1);
+	}
+	printf("TEST 1: Incompressible round trip success (%d -> %d bytes) \n", CLUSTER, clen);
+
+
+	/* TEST 2: highly repetitive input, one long run and a short period that overlaps its own match */
+	memset(in, 0, CLUSTER);
+	if (round_trip(CLUSTER, &clen) < 0 || clen > CLUSTER / 64) {
+		printf("TEST 2: Repetitive round trip failure \n");
+		exit(1);
+	}
+	for (int i = 0; i < CLUSTER; i++)
+		in[i] = "abc"[i % 3];
+	if (round_trip(CLUSTER, &clen) < 0 || clen > CLUSTER / 64) {
+		printf("TEST 2: Repetitive round trip failure \n");
+		exit(1);
+	}
+	printf("TEST 2: Repetitive round trip success (%d -> %d bytes) \n", CLUSTER, clen);
+
+
+	/* TEST 3: matches running to the cluster boundary, from half a cluster back and from its first block */
+	fill_random(in, CLUSTER / 2, 0x9e3779b9);
+	memcpy(in + CLUSTER / 2, in, CLUSTER / 2);
+	/* the small hash table finds the copy some way into it, from there one match runs to the end */
+	if (round_trip(CLUSTER, &clen) < 0 || clen > CLUSTER * 3 / 4) {
+		printf("TEST 3: Cluster boundary round trip failure \n");
+		exit(1);
+	}
+	memset(in, 0, CLUSTER);
+	fill_random(in, 4096, 0x85ebca6b);
+	memcpy(in + CLUSTER - 4096, in, 4096);
+	if (round_trip(CLUSTER, &clen) < 0 || clen > 4096 + 4096 / 2) {
+		printf("TEST 3: Cluster boundary round trip failure \n");
+		exit(1);
+	}
+	if (lz_compress(in, CLUSTER + 1, out, sizeof(out)) != 0) {
+		printf("TEST 3: Input past a cluster was not refused \n");
+		exit(1);
+	}
+	printf("TEST 3: Cluster boundary round trip success \n");
+
+
+	/* TEST 4: a cut short or corrupt stream is refused */
+	fill_random(in, CLUSTER / 2, 0xc2b2ae35);
+	memcpy(in + CLUSTER / 2, in, CLUSTER / 2);
+	clen = lz_compress(in, CLUSTER, out, sizeof(out));
+	for (int cut = 1; cut < clen; cut += 97) {
+		int n = lz_decompress(out, cut, back, CLUSTER);
+		if (n > CLUSTER || (n >= 0 && memcmp(in, back, n) != 0)) {
+			printf("TEST 4: Truncated stream failure \n");
+			exit(1);
+		}
+	}
+	out[clen - 2] ^= 0xff;
+	if (lz_decompress(out, clen, back, CLUSTER) == CLUSTER && memcmp(in, back, CLUSTER) == 0) {
+		printf("TEST 4: Corrupt stream failure \n");
+		exit(1);
+	}
+	printf("TEST 4: Corrupt stream success \n");
+
+	return 0;
+}
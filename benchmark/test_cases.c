@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,6 +9,10 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <time.h>
+#include <sys/ioctl.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <linux/falloc.h>
 
 /* You need to change this macro to your TFS mount point*/
 #define TESTDIR "/tmp/ttd31/mountdir"
@@ -17,10 +22,33 @@
 #define FSPATHLEN 256
 #define ITERS 16
 #define ITERS_LARGE 2048
+#define CLUSTER_ITERS 40
 #define FILEPERM 0666
 #define DIRPERM 0755
 
+/* From rufs.h, which cannot be included next to dirent.h */
+struct rufs_clone_range {
+	uint64_t	src_offset;
+	uint64_t	length;
+	uint64_t	dest_offset;
+	char		src_path[PATH_MAX];
+};
+
+#define RUFS_IOC_CLONE_RANGE _IOW('r', 1, struct rufs_clone_range)
+
 char buf[BLOCKSIZE];
+char image[CLUSTER_ITERS*BLOCKSIZE], readback[CLUSTER_ITERS*BLOCKSIZE];
+
+/* Reads block i of fd and checks it is filled with c */
+static int check_block(int fd, int i, char c) {
+	memset(buf, 0, BLOCKSIZE);
+	if (pread(fd, buf, BLOCKSIZE, (off_t) i*BLOCKSIZE) != BLOCKSIZE)
+		return -1;
+	for (int j = 0; j < BLOCKSIZE; j++)
+		if (buf[j] != c)
+			return -1;
+	return 0;
+}
 
 int main(int argc, char **argv) {
 
@@ -131,6 +159,221 @@ int main(int argc, char **argv) {
 	printf("TEST 7: Sub-directory create success \n");
 
 
+	/* TEST 8: clone range test */
+	int src, dst;
+	struct rufs_clone_range range;
+
+	if ((src = open(TESTDIR "/clonesrc", O_RDWR | O_CREAT, FILEPERM)) < 0 ||
+	    (dst = open(TESTDIR "/clonedst", O_RDWR | O_CREAT, FILEPERM)) < 0) {
+		perror("open");
+		printf("TEST 8: File clone failure \n");
+		exit(1);
+	}
+
+	for (i = 0; i < ITERS; i++) {
+		memset(buf, 0x61 + i, BLOCKSIZE);
+		if (write(src, buf, BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 8: File clone failure \n");
+			exit(1);
+		}
+	}
+
+	memset(&range, 0, sizeof(range));
+	strcpy(range.src_path, "/clonesrc");
+	if (ioctl(dst, RUFS_IOC_CLONE_RANGE, &range) < 0) {
+		perror("ioctl");
+		printf("TEST 8: File clone failure \n");
+		exit(1);
+	}
+
+	fstat(dst, &st);
+	if (st.st_size != ITERS*BLOCKSIZE) {
+		printf("TEST 8: File clone failure \n");
+		exit(1);
+	}
+	for (i = 0; i < ITERS; i++) {
+		if (check_block(dst, i, 0x61 + i) < 0) {
+			printf("TEST 8: File clone failure \n");
+			exit(1);
+		}
+	}
+
+	/* Writing either file must leave the blocks the other sees alone */
+	memset(buf, 'x', BLOCKSIZE);
+	if (pwrite(dst, buf, BLOCKSIZE, 3*BLOCKSIZE) != BLOCKSIZE) {
+		printf("TEST 8: File clone failure \n");
+		exit(1);
+	}
+	memset(buf, 'y', BLOCKSIZE);
+	if (pwrite(src, buf, BLOCKSIZE, 5*BLOCKSIZE) != BLOCKSIZE) {
+		printf("TEST 8: File clone failure \n");
+		exit(1);
+	}
+
+	if (check_block(src, 3, 0x61 + 3) < 0 || check_block(dst, 3, 'x') < 0 ||
+	    check_block(dst, 5, 0x61 + 5) < 0 || check_block(src, 5, 'y') < 0) {
+		printf("TEST 8: File clone copy-on-write failure \n");
+		exit(1);
+	}
+
+	close(src);
+	close(dst);
+	printf("TEST 8: File clone success \n");
+
+
+	/*
+	 * TEST 9: compressed file test, mount with -o compress for it to go
+	 * through the 16 block clusters. A run of one byte straddles the
+	 * first cluster boundary and the tail does not compress at all. The
+	 * rest of the tests pass on either mount, TEST 10 is skipped on this one.
+	 */
+	unsigned int seed = 0x2545f491;
+	for (i = 0; i < CLUSTER_ITERS*BLOCKSIZE; i++) {
+		if (i < 12*BLOCKSIZE)
+			image[i] = 0x61 + i / BLOCKSIZE;
+		else if (i < 21*BLOCKSIZE)
+			image[i] = 'z';
+		else {
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			image[i] = seed;
+		}
+	}
+
+	if ((fd = open(TESTDIR "/compressed", O_RDWR | O_CREAT, FILEPERM)) < 0) {
+		perror("open");
+		printf("TEST 9: Compressed file failure \n");
+		exit(1);
+	}
+	for (i = 0; i < CLUSTER_ITERS; i++) {
+		if (write(fd, image + i*BLOCKSIZE, BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 9: Compressed file write failure \n");
+			exit(1);
+		}
+	}
+	close(fd);
+
+	/* and a small overwrite across the boundary, which has to decompress both clusters around it */
+	if ((fd = open(TESTDIR "/compressed", O_RDWR)) < 0) {
+		perror("open");
+		printf("TEST 9: Compressed file failure \n");
+		exit(1);
+	}
+	memset(image + 16*BLOCKSIZE - 50, 'Q', 100);
+	if (pwrite(fd, image + 16*BLOCKSIZE - 50, 100, 16*BLOCKSIZE - 50) != 100) {
+		printf("TEST 9: Compressed file write failure \n");
+		exit(1);
+	}
+	close(fd);
+
+	if ((fd = open(TESTDIR "/compressed", O_RDONLY)) < 0) {
+		perror("open");
+		printf("TEST 9: Compressed file failure \n");
+		exit(1);
+	}
+	if (pread(fd, readback, sizeof(readback), 0) != sizeof(readback) ||
+	    memcmp(image, readback, sizeof(readback)) != 0) {
+		printf("TEST 9: Compressed file read failure \n");
+		exit(1);
+	}
+	printf("TEST 9: Compressed file success \n");
+	close(fd);
+
+
+	/* TEST 10: fallocate with FALLOC_FL_KEEP_SIZE test */
+	if ((fd = open(TESTDIR "/falloc", O_RDWR | O_CREAT, FILEPERM)) < 0) {
+		perror("open");
+		printf("TEST 10: File fallocate failure \n");
+		exit(1);
+	}
+	memset(buf, 'a', BLOCKSIZE);
+	if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+		printf("TEST 10: File fallocate failure \n");
+		exit(1);
+	}
+
+	/* compressed files cannot preallocate, so on a -o compress mount this one is skipped */
+	ret = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, 8*BLOCKSIZE);
+	if (ret < 0 && errno == EOPNOTSUPP) {
+		printf("TEST 10: File fallocate skipped, not supported on this mount \n");
+	} else {
+		if (ret < 0) {
+			perror("fallocate");
+			printf("TEST 10: File fallocate failure \n");
+			exit(1);
+		}
+
+		/* the size stays put, the blocks are held and nothing past the end reads */
+		fstat(fd, &st);
+		if (st.st_size != BLOCKSIZE || st.st_blocks * 512 < 8*BLOCKSIZE ||
+		    pread(fd, buf, BLOCKSIZE, BLOCKSIZE) != 0) {
+			printf("TEST 10: File fallocate keep size failure \n");
+			exit(1);
+		}
+
+		/* writing the last reserved block takes in the ones before it, which read as zeros */
+		memset(buf, 'b', BLOCKSIZE);
+		if (pwrite(fd, buf, BLOCKSIZE, 7*BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 10: File fallocate failure \n");
+			exit(1);
+		}
+		fstat(fd, &st);
+		if (st.st_size != 8*BLOCKSIZE || st.st_blocks * 512 != 8*BLOCKSIZE ||
+		    check_block(fd, 0, 'a') < 0 || check_block(fd, 7, 'b') < 0) {
+			printf("TEST 10: File fallocate failure \n");
+			exit(1);
+		}
+		for (i = 1; i < 7; i++) {
+			if (check_block(fd, i, 0) < 0) {
+				printf("TEST 10: File fallocate reserved block read failure \n");
+				exit(1);
+			}
+		}
+		printf("TEST 10: File fallocate success \n");
+	}
+
+
+	/* TEST 11: two handles on one file, one closing while the other has writes buffered */
+	int first, second;
+	if ((first = open(TESTDIR "/handles", O_RDWR | O_CREAT, FILEPERM)) < 0) {
+		perror("open");
+		printf("TEST 11: Two handle failure \n");
+		exit(1);
+	}
+	memset(buf, 'A', 200);
+	if (write(first, buf, 200) != 200) {
+		printf("TEST 11: Two handle write failure \n");
+		exit(1);
+	}
+	if ((second = open(TESTDIR "/handles", O_RDWR)) < 0 || close(second) < 0) {
+		perror("open");
+		printf("TEST 11: Two handle failure \n");
+		exit(1);
+	}
+
+	/* the first handle's data must survive the second closing, and its next write land where asked */
+	memset(buf, 'B', 100);
+	if (pwrite(first, buf, 100, 1000) != 100) {
+		printf("TEST 11: Two handle write failure \n");
+		exit(1);
+	}
+	if ((second = open(TESTDIR "/handles", O_RDONLY)) < 0 ||
+	    pread(second, readback, 1100, 0) != 1100) {
+		printf("TEST 11: Two handle read failure \n");
+		exit(1);
+	}
+	for (i = 0; i < 1100; i++) {
+		if (readback[i] != (i < 200 ? 'A' : i < 1000 ? 0 : 'B')) {
+			printf("TEST 11: Two handle read failure at byte %d \n", i);
+			exit(1);
+		}
+	}
+	close(second);
+	close(first);
+	printf("TEST 11: Two handle success \n");
+
+
 	/* Close operation */	
 	if (close(fd) < 0) {
 		perror("close largefile");
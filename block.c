@@ -14,16 +14,210 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+//linux/fs.h, pulled in by io_uring.h, has a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
 
 #include "block.h"
+#include "crc32c.h"
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+//Blocks per preadv/pwritev call, well under the kernel's IOV_MAX
+#define IOV_BATCH	256
 
 int diskfile = -1;
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+/*
+ * DEV_MMAP maps the whole disk file; blocks are then read, written and
+ * handed out by bio_get() in place, and dirty blocks are tracked in
+ * dev_dirty so bio_flush() can msync just those ranges.
+ */
+int dev_mode = DEV_PIO;
+unsigned char *dev_map = NULL, *dev_dirty = NULL;
+int dev_nblocks = 0;
+
+/*
+ * Buffer cache: a fixed pool of block buffers indexed by a hash table on
+ * block number and kept on an LRU list (head = most recent). Writes only
+ * dirty the cached copy; dirty buffers reach the disk when they are evicted
+ * or on bio_flush().
+ */
+struct cache_buf {
+	int					blkno;		/* cached block number, -1 if unused */
+	int					dirty;		/* differs from the on-disk copy */
+	int					pins;		/* outstanding bio_get() references */
+	int					ra;			/* loaded by readahead and not read yet */
+	struct cache_buf	*hnext;		/* hash chain */
+	struct cache_buf	*prev;		/* LRU list */
+	struct cache_buf	*next;
+	unsigned char		*data;
+};
+
+struct cache_buf *cache_pool = NULL, **cache_hash = NULL, **cache_dirty = NULL;
+struct cache_buf cache_lru;
+unsigned char *cache_data = NULL;
+int cache_size = 0, cache_hash_mask = 0;
+
+struct bio_cache_stats cache_stats;
+
+//Bumped before anything is written to the disk, so readahead can tell its data may be stale
+unsigned long dev_wgen = 0;
+
+/*
+ * cache_lock guards the hash, LRU list, pins, dirty bits and stats. Block
+ * contents handed out by bio_get are protected by the caller's own locks.
+ * flush_lock serializes bio_flush, which uses the shared cache_dirty array.
+ */
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER, flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Block checksums, set up by bio_csum_init. csum_table holds the CRC32C of
+ * every block as it was last written, 0 while it is not known (a CRC of 0
+ * is stored as 1). Every write to the disk updates it, and bio_flush writes
+ * the table blocks marked in csum_dirty to csum_nblk blocks at csum_start.
+ * Those blocks are not covered, nor is block 0, the superblock, which has
+ * to say whether the table can be trusted. A block read into the cache is
+ * verified; with BIO_CSUM_DATA so are vectored and batched reads. A pinned
+ * buffer bio_flush writes may change under it, checksum and all, but it is
+ * then dirty again and written once more before the disk copy is read.
+ */
+uint32_t *csum_table = NULL;
+unsigned char *csum_dirty = NULL;
+int csum_start = 0, csum_nblk = 0, csum_nblocks = 0, csum_flags = 0;
+unsigned long csum_errors = 0;
+
+/*
+ * A run of count contiguous blocks moved to or from bufs[0..count). Every
+ * disk transfer beyond a single block is expressed as a list of these and
+ * handed to dev_rw, which runs them synchronously or through io_uring.
+ */
+struct dev_op {
+	int		block_num;
+	int		count;
+	void	**bufs;
+	int		write;
+};
+
+/*
+ * io_uring submission/completion rings, set up by bio_uring_init and
+ * driven with raw syscalls. fd < 0 means the synchronous backend is used.
+ */
+struct uring {
+	int						fd;
+	unsigned				entries;
+	unsigned				*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned				*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe		*sqes;
+	struct io_uring_cqe		*cqes;
+	void					*sq_ring, *cq_ring;
+	size_t					sq_ring_sz, cq_ring_sz;
+};
+
+struct uring ring = { .fd = -1 };
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void cache_free();
+static void uring_free();
+static int dev_rw(struct dev_op *ops, int n);
+
+static int csum_covers(const int block_num) {
+	return csum_table != NULL && block_num > 0 && block_num < csum_nblocks && (block_num < csum_start || block_num >= csum_start + csum_nblk);
+}
+
+static uint32_t csum_block(const void *buf) {
+	uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+	return crc ? crc : 1;
+}
+
+//Records the checksum of buf as about to be written to block_num
+static void csum_update(const int block_num, const void *buf) {
+	if ( ! csum_covers(block_num) ) return;
+	__atomic_store_n(&csum_table[block_num], csum_block(buf), __ATOMIC_RELAXED);
+	__atomic_store_n(&csum_dirty[block_num / BIO_CSUM_PER_BLOCK], 1, __ATOMIC_RELEASE);
+}
+
+//Whether buf as read from block_num matches its checksum, or there is none to compare with
+static int csum_verify(const int block_num, const void *buf) {
+	if ( ! csum_covers(block_num) ) return 1;
+	uint32_t crc = __atomic_load_n(&csum_table[block_num], __ATOMIC_RELAXED);
+	return crc == 0 || csum_block(buf) == crc;
+}
+
+static int csum_error(const int block_num) {
+	fprintf(stderr, "rufs: checksum mismatch in block %d\n", block_num);
+	__atomic_fetch_add(&csum_errors, 1, __ATOMIC_RELAXED);
+	errno = EIO;
+	return -1;
+}
+
+//Maps the opened disk file when running in DEV_MMAP mode
+static int dev_map_file() {
+	if ( dev_mode != DEV_MMAP ) return 0;
+
+	struct stat st;
+	if ( fstat(diskfile, &st) < 0 ) {
+		perror("disk_stat failed");
+		return -1;
+	}
+
+	dev_nblocks = st.st_size / BLOCK_SIZE;
+	dev_map = mmap(NULL, (size_t) dev_nblocks * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+	if ( dev_map == MAP_FAILED ) {
+		perror("disk_mmap failed");
+		dev_map = NULL;
+		return -1;
+	}
+
+	dev_dirty = calloc((dev_nblocks + 7) / 8, 1);
+	if ( dev_dirty == NULL ) {
+		munmap(dev_map, (size_t) dev_nblocks * BLOCK_SIZE);
+		dev_map = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void map_mark_dirty(const int block_num) {
+	__atomic_fetch_or(&dev_dirty[block_num / 8], 1 << (block_num & 7), __ATOMIC_RELAXED);
+}
+
+//Clears block_num's dirty bit, returning whether it was set
+static int map_clear_dirty(const int block_num) {
+	if ( ! (__atomic_load_n(&dev_dirty[block_num / 8], __ATOMIC_RELAXED) & (1 << (block_num & 7))) ) return 0;
+	return __atomic_fetch_and(&dev_dirty[block_num / 8], ~(1 << (block_num & 7)), __ATOMIC_RELAXED) & (1 << (block_num & 7));
+}
+
+//Writes back the dirty blocks of the mapping, one msync per contiguous run
+static int map_flush() {
+	int count = 0;
+
+	for ( int i = 0; i < dev_nblocks; i++ ) {
+		if ( ! map_clear_dirty(i) ) continue;
+
+		int run = i + 1;
+		while ( run < dev_nblocks && map_clear_dirty(run) ) run++;
+
+		if ( msync(dev_map + (size_t) i * BLOCK_SIZE, (size_t) (run - i) * BLOCK_SIZE, MS_SYNC) < 0 ) {
+			perror("block_msync failed");
+			return -1;
+		}
+
+		count += run - i;
+		i = run;
+	}
+
+	return count;
+}
+
+//Creates a file which is your new emulated disk, nblocks long and reading back as zeros
+void dev_init(const char* diskfile_path, const int nblocks) {
     if (diskfile >= 0) {
 		return;
     }
@@ -34,7 +228,14 @@ void dev_init(const char* diskfile_path) {
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    if (ftruncate(diskfile, 0) < 0 || ftruncate(diskfile, (off_t) nblocks * BLOCK_SIZE) < 0) {
+		perror("disk_init failed");
+		exit(EXIT_FAILURE);
+    }
+
+    if (dev_map_file() < 0) {
+		exit(EXIT_FAILURE);
+    }
 }
 
 //Function to open the disk file
@@ -48,35 +249,969 @@ int dev_open(const char* diskfile_path) {
 		perror("disk_open failed");
 		return -1;
     }
+
+    if (dev_map_file() < 0) {
+		exit(EXIT_FAILURE);
+    }
 	return 0;
 }
 
 void dev_close() {
     if (diskfile >= 0) {
+		bio_flush();
+		if (dev_map != NULL) {
+			munmap(dev_map, (size_t) dev_nblocks * BLOCK_SIZE);
+			free(dev_dirty);
+			dev_map = NULL;
+			dev_dirty = NULL;
+		}
 		close(diskfile);
+		diskfile = -1;
     }
+	free(csum_table);
+	free(csum_dirty);
+	csum_table = NULL;
+	csum_dirty = NULL;
+	cache_free();
+	uring_free();
 }
 
-//Read a block from the disk
-int bio_read(const int block_num, void *buf) {
+//Selects the device backend used by the next dev_init/dev_open
+void dev_set_mode(int mode) {
+	dev_mode = mode;
+}
+
+static int dev_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    retstat = pread(diskfile, buf, BLOCK_SIZE, (off_t) block_num*BLOCK_SIZE);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
 			perror("block_read failed");
     }
+    if (retstat >= 0 && ! csum_verify(block_num, buf)) {
+		return csum_error(block_num);
+    }
 
     return retstat;
 }
 
-//Write a block to the disk
-int bio_write(const int block_num, const void *buf) {
+static int dev_write(const int block_num, const void *buf) {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    csum_update(block_num, buf);
+    __atomic_fetch_add(&dev_wgen, 1, __ATOMIC_SEQ_CST);
+    retstat = pwrite(diskfile, buf, BLOCK_SIZE, (off_t) block_num*BLOCK_SIZE);
     if (retstat < 0) {
 		    perror("block_write failed");
     }
     return retstat;
 }
 
+static void lru_unlink(struct cache_buf *cb) {
+	cb->prev->next = cb->next;
+	cb->next->prev = cb->prev;
+}
+
+static void lru_push(struct cache_buf *cb) {
+	cb->next = cache_lru.next;
+	cb->prev = &cache_lru;
+	cache_lru.next->prev = cb;
+	cache_lru.next = cb;
+}
+
+static void lru_push_tail(struct cache_buf *cb) {
+	cb->prev = cache_lru.prev;
+	cb->next = &cache_lru;
+	cache_lru.prev->next = cb;
+	cache_lru.prev = cb;
+}
+
+static struct cache_buf **hash_slot(const int block_num) {
+	return &cache_hash[block_num & cache_hash_mask];
+}
+
+static void hash_remove(struct cache_buf *cb) {
+	struct cache_buf **pp = hash_slot(cb->blkno);
+	while ( *pp != cb ) pp = &(*pp)->hnext;
+	*pp = cb->hnext;
+}
+
+static struct cache_buf *cache_lookup(const int block_num) {
+	struct cache_buf *cb = *hash_slot(block_num);
+	while ( cb != NULL && cb->blkno != block_num ) cb = cb->hnext;
+	return cb;
+}
+
+//Takes the least recently used unpinned buffer, writing it back first if dirty, and rebinds it to block_num
+static struct cache_buf *cache_alloc(const int block_num) {
+	struct cache_buf *cb;
+	int failed = 0;
+
+	//A buffer whose write-back fails keeps its block and stays dirty, and the next one is tried
+	for ( cb = cache_lru.prev; cb != &cache_lru; cb = cb->prev ) {
+		if ( cb->pins > 0 ) continue;
+		if ( cb->blkno < 0 || ! cb->dirty ) break;
+		if ( dev_write(cb->blkno, cb->data) == BLOCK_SIZE ) {
+			cache_stats.writebacks++;
+			break;
+		}
+		failed++;
+	}
+	if ( cb == &cache_lru ) {
+		if ( failed ) fprintf(stderr, "block cache exhausted: %d buffers could not be written back\n", failed);
+		else fprintf(stderr, "block cache exhausted: all %d buffers pinned\n", cache_size);
+		return NULL;
+	}
+
+	if ( cb->blkno >= 0 ) {
+		hash_remove(cb);
+		cache_stats.evictions++;
+	}
+
+	cb->blkno = block_num;
+	cb->dirty = 0;
+	cb->pins = 0;
+	cb->ra = 0;
+	cb->hnext = *hash_slot(block_num);
+	*hash_slot(block_num) = cb;
+
+	lru_unlink(cb);
+	lru_push(cb);
+
+	return cb;
+}
+
+static void cache_free() {
+	if ( cache_size > 0 ) bio_flush();
+
+	free(cache_pool);
+	free(cache_hash);
+	free(cache_dirty);
+	free(cache_data);
+	cache_pool = NULL;
+	cache_hash = NULL;
+	cache_dirty = NULL;
+	cache_data = NULL;
+	cache_size = 0;
+}
+
+//Sizes the buffer cache to nblocks buffers (at least BIO_MIN_CACHE_BLOCKS). Flushes and drops any existing cache
+int bio_cache_init(int nblocks) {
+	cache_free();
+	memset(&cache_stats, 0, sizeof(cache_stats));
+	__atomic_store_n(&csum_errors, 0, __ATOMIC_RELAXED);
+
+	if ( nblocks < BIO_MIN_CACHE_BLOCKS ) nblocks = BIO_MIN_CACHE_BLOCKS;
+
+	int hash_size = 1;
+	while ( hash_size < nblocks ) hash_size <<= 1;
+
+	cache_pool = calloc(nblocks, sizeof(struct cache_buf));
+	cache_hash = calloc(hash_size, sizeof(struct cache_buf *));
+	cache_dirty = calloc(nblocks, sizeof(struct cache_buf *));
+	cache_data = malloc((size_t) nblocks * BLOCK_SIZE);
+	if ( cache_pool == NULL || cache_hash == NULL || cache_dirty == NULL || cache_data == NULL ) {
+		cache_free();
+		return -1;
+	}
+
+	cache_size = nblocks;
+	cache_hash_mask = hash_size - 1;
+	cache_lru.next = cache_lru.prev = &cache_lru;
+
+	for ( int i = 0; i < nblocks; i++ ) {
+		cache_pool[i].blkno = -1;
+		cache_pool[i].data = cache_data + (size_t) i * BLOCK_SIZE;
+		lru_push(&cache_pool[i]);
+	}
+
+	return 0;
+}
+
+static int cmp_blkno(const void *a, const void *b) {
+	return (*(struct cache_buf **) a)->blkno - (*(struct cache_buf **) b)->blkno;
+}
+
+//Writes out the table blocks changed since the last call. Called by bio_flush, after the blocks they describe
+static int csum_flush() {
+	if ( csum_table == NULL ) return 0;
+
+	int count = 0;
+	for ( int i = 0; i < csum_nblk; i++ ) {
+		if ( __atomic_load_n(&csum_dirty[i], __ATOMIC_RELAXED) ) count++;
+	}
+	if ( count == 0 ) return 0;
+
+	unsigned char *data = malloc((size_t) count * BLOCK_SIZE);
+	if ( data == NULL ) return -1;
+
+	//Each block is copied out after its mark is cleared, so an update racing with the copy marks it again
+	void *bufs[count];
+	struct dev_op ops[count];
+	int n = 0, k = 0;
+
+	for ( int i = 0; i < csum_nblk && k < count; i++ ) {
+		if ( ! __atomic_exchange_n(&csum_dirty[i], 0, __ATOMIC_ACQUIRE) ) continue;
+
+		uint32_t *table = (uint32_t *) (data + (size_t) k * BLOCK_SIZE);
+		for ( int j = 0; j < BIO_CSUM_PER_BLOCK; j++ ) table[j] = __atomic_load_n(&csum_table[(size_t) i * BIO_CSUM_PER_BLOCK + j], __ATOMIC_RELAXED);
+		bufs[k] = table;
+
+		if ( n > 0 && ops[n - 1].block_num + ops[n - 1].count == csum_start + i && ops[n - 1].count < IOV_BATCH ) ops[n - 1].count++;
+		else {
+			ops[n].block_num = csum_start + i;
+			ops[n].count = 1;
+			ops[n].bufs = &bufs[k];
+			ops[n].write = 1;
+			n++;
+		}
+		k++;
+	}
+
+	int retval = dev_rw(ops, n);
+	if ( retval < 0 ) {
+		for ( int i = 0; i < n; i++ ) {
+			for ( int j = 0; j < ops[i].count; j++ ) __atomic_store_n(&csum_dirty[ops[i].block_num - csum_start + j], 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	free(data);
+	return retval;
+}
+
+/*
+ * Turns on checksums for a disk of nblocks blocks whose table starts at
+ * start_blk. The table is read from the disk, or with fresh set starts
+ * out knowing no checksums. flags is BIO_CSUM_META, with BIO_CSUM_DATA
+ * to verify data reads as well. Call before the disk is in use.
+ */
+int bio_csum_init(int start_blk, int nblocks, int fresh, int flags) {
+	int nblk = (nblocks + BIO_CSUM_PER_BLOCK - 1) / BIO_CSUM_PER_BLOCK;
+
+	uint32_t *table = calloc((size_t) nblk * BIO_CSUM_PER_BLOCK, sizeof(uint32_t));
+	unsigned char *dirty = calloc(nblk, 1);
+	if ( table == NULL || dirty == NULL ) {
+		free(table);
+		free(dirty);
+		return -1;
+	}
+
+	if ( fresh ) memset(dirty, 1, nblk);
+
+	for ( int i = 0; ! fresh && i < nblk; i += IOV_BATCH ) {
+		void *bufs[IOV_BATCH];
+		struct dev_op op = { .block_num = start_blk + i, .count = nblk - i < IOV_BATCH ? nblk - i : IOV_BATCH, .bufs = bufs, .write = 0 };
+
+		for ( int j = 0; j < op.count; j++ ) bufs[j] = table + (size_t) (i + j) * BIO_CSUM_PER_BLOCK;
+
+		if ( dev_rw(&op, 1) < 0 ) {
+			free(table);
+			free(dirty);
+			return -1;
+		}
+	}
+
+	csum_start = start_blk;
+	csum_nblk = nblk;
+	csum_nblocks = nblocks;
+	csum_flags = flags;
+	csum_dirty = dirty;
+	csum_table = table;
+
+	return 0;
+}
+
+//Writes every dirty buffer back to the disk in block order, then the checksums
+int bio_flush() {
+	if ( dev_map != NULL ) return map_flush();
+
+	pthread_mutex_lock(&flush_lock);
+	pthread_mutex_lock(&cache_lock);
+
+	//Dirty bits are cleared up front so a bio_dirty racing with the write-back keeps the block dirty
+	int count = 0;
+	for ( int i = 0; i < cache_size; i++ ) {
+		if ( cache_pool[i].blkno >= 0 && cache_pool[i].dirty ) {
+			cache_pool[i].dirty = 0;
+			cache_pool[i].pins++;
+			cache_dirty[count++] = &cache_pool[i];
+		}
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	if ( count == 0 ) {
+		int retval = csum_flush();
+		pthread_mutex_unlock(&flush_lock);
+		return retval < 0 ? -1 : 0;
+	}
+
+	qsort(cache_dirty, count, sizeof(struct cache_buf *), cmp_blkno);
+
+	//One write per contiguous run, all submitted together
+	struct dev_op ops[count];
+	void *bufs[count];
+	int n = 0;
+
+	for ( int i = 0; i < count; i++ ) {
+		bufs[i] = cache_dirty[i]->data;
+		if ( n > 0 && ops[n - 1].block_num + ops[n - 1].count == cache_dirty[i]->blkno && ops[n - 1].count < IOV_BATCH ) {
+			ops[n - 1].count++;
+			continue;
+		}
+		ops[n].block_num = cache_dirty[i]->blkno;
+		ops[n].count = 1;
+		ops[n].bufs = &bufs[i];
+		ops[n].write = 1;
+		n++;
+	}
+
+	int retval = dev_rw(ops, n);
+
+	pthread_mutex_lock(&cache_lock);
+	for ( int i = 0; i < count; i++ ) {
+		if ( retval < 0 ) cache_dirty[i]->dirty = 1;
+		cache_dirty[i]->pins--;
+	}
+	if ( retval == 0 ) cache_stats.writebacks += count;
+	pthread_mutex_unlock(&cache_lock);
+
+	if ( retval == 0 ) retval = csum_flush();
+
+	pthread_mutex_unlock(&flush_lock);
+
+	return retval < 0 ? -1 : count;
+}
+
+void bio_cache_stats(struct bio_cache_stats *stats) {
+	pthread_mutex_lock(&cache_lock);
+	*stats = cache_stats;
+	pthread_mutex_unlock(&cache_lock);
+	stats->csum_errors = __atomic_load_n(&csum_errors, __ATOMIC_RELAXED);
+}
+
+/*
+ * Finds or loads block_num in the cache and moves it to the head of the
+ * LRU list. With load unset a missing block is not read in, for callers
+ * about to overwrite all of it. Called with cache_lock held; a miss reads
+ * the disk under the lock so no one can see a half-loaded buffer. NULL
+ * with *failed set means the block could not be read (or failed its
+ * checksum), NULL alone that no buffer was free.
+ */
+static struct cache_buf *cache_getblk(const int block_num, const int load, int *failed) {
+	struct cache_buf *cb = cache_lookup(block_num);
+	if ( cb != NULL ) {
+		if ( load ) cache_stats.hits++;
+		cb->ra = 0;
+		lru_unlink(cb);
+		lru_push(cb);
+		return cb;
+	}
+
+	if ( load ) cache_stats.misses++;
+	cb = cache_alloc(block_num);
+	if ( cb == NULL || ! load ) return cb;
+
+	if ( dev_read(block_num, cb->data) < 0 ) {
+		hash_remove(cb);
+		cb->blkno = -1;
+		if ( failed != NULL ) *failed = 1;
+		return NULL;
+	}
+	return cb;
+}
+
+//Read a block from the disk
+int bio_read(const int block_num, void *buf) {
+	if ( dev_map != NULL ) {
+		if ( block_num < 0 || block_num >= dev_nblocks ) {
+			memset(buf, 0, BLOCK_SIZE);
+			return 0;
+		}
+		memcpy(buf, dev_map + (size_t) block_num * BLOCK_SIZE, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+
+	if ( cache_size == 0 ) return dev_read(block_num, buf);
+
+	int failed = 0;
+	pthread_mutex_lock(&cache_lock);
+	struct cache_buf *cb = cache_getblk(block_num, 1, &failed);
+	if ( cb != NULL ) memcpy(buf, cb->data, BLOCK_SIZE);
+	pthread_mutex_unlock(&cache_lock);
+
+	//A block that failed to load is not read again, which would report it twice; only a full cache goes to the disk
+	if ( failed ) {
+		memset(buf, 0, BLOCK_SIZE);
+		errno = EIO;
+		return -1;
+	}
+	if ( cb == NULL ) return dev_read(block_num, buf);
+	return BLOCK_SIZE;
+}
+
+//Write a block to the disk
+int bio_write(const int block_num, const void *buf) {
+	if ( dev_map != NULL ) {
+		if ( block_num < 0 || block_num >= dev_nblocks ) {
+			fprintf(stderr, "block_write failed: block %d out of range\n", block_num);
+			return -1;
+		}
+		memcpy(dev_map + (size_t) block_num * BLOCK_SIZE, buf, BLOCK_SIZE);
+		map_mark_dirty(block_num);
+		return BLOCK_SIZE;
+	}
+
+	if ( cache_size == 0 ) return dev_write(block_num, buf);
+
+	pthread_mutex_lock(&cache_lock);
+	struct cache_buf *cb = cache_getblk(block_num, 0, NULL);
+	if ( cb != NULL ) {
+		memcpy(cb->data, buf, BLOCK_SIZE);
+		cb->dirty = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if ( cb == NULL ) return dev_write(block_num, buf);
+	return BLOCK_SIZE;
+}
+
+/*
+ * In-place access. bio_get returns the block's contents without copying:
+ * a pointer into the mapping in DEV_MMAP mode, otherwise a cache buffer
+ * that stays pinned until the matching bio_put. Modifications must be
+ * reported with bio_dirty before the block is put.
+ */
+void *bio_get(const int block_num) {
+	if ( dev_map != NULL ) {
+		if ( block_num < 0 || block_num >= dev_nblocks ) return NULL;
+		return dev_map + (size_t) block_num * BLOCK_SIZE;
+	}
+
+	if ( cache_size == 0 ) return NULL;
+
+	pthread_mutex_lock(&cache_lock);
+	struct cache_buf *cb = cache_getblk(block_num, 1, NULL);
+	if ( cb != NULL ) cb->pins++;
+	pthread_mutex_unlock(&cache_lock);
+
+	return cb != NULL ? cb->data : NULL;
+}
+
+static struct cache_buf *cache_buf_of(const void *data) {
+	return &cache_pool[((const unsigned char *) data - cache_data) / BLOCK_SIZE];
+}
+
+void bio_dirty(const void *data) {
+	if ( dev_map != NULL ) {
+		map_mark_dirty(((const unsigned char *) data - dev_map) / BLOCK_SIZE);
+		return;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	cache_buf_of(data)->dirty = 1;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void bio_put(const void *data) {
+	if ( dev_map != NULL ) return;
+
+	pthread_mutex_lock(&cache_lock);
+	cache_buf_of(data)->pins--;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+
+//Zero-fills whatever a short read at the end of the disk file left untouched in bufs
+static void zero_tail(void **bufs, int count, size_t bytes) {
+	int full = bytes / BLOCK_SIZE;
+	for ( int i = full; i < count; i++ ) {
+		size_t valid = i == full ? bytes % BLOCK_SIZE : 0;
+		memset((unsigned char *) bufs[i] + valid, 0, BLOCK_SIZE - valid);
+	}
+}
+
+static int dev_rw_sync(struct dev_op *op) {
+	struct iovec iov[op->count < IOV_BATCH ? op->count : IOV_BATCH];
+	int done = 0;
+
+	while ( done < op->count ) {
+		int n = op->count - done < IOV_BATCH ? op->count - done : IOV_BATCH;
+		for ( int i = 0; i < n; i++ ) {
+			iov[i].iov_base = op->bufs[done + i];
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+
+		off_t pos = (off_t) (op->block_num + done) * BLOCK_SIZE;
+		ssize_t retstat = op->write ? pwritev(diskfile, iov, n, pos) : preadv(diskfile, iov, n, pos);
+		if ( retstat < 0 ) {
+			perror(op->write ? "block_writev failed" : "block_readv failed");
+			return -1;
+		}
+		if ( ! op->write ) zero_tail(op->bufs + done, n, retstat);
+
+		done += n;
+	}
+
+	return 0;
+}
+
+static int uring_setup(unsigned depth) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	int fd = syscall(__NR_io_uring_setup, depth, &p);
+	if ( fd < 0 ) {
+		perror("io_uring_setup failed");
+		return -1;
+	}
+
+	ring.sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) {
+		if ( ring.cq_ring_sz > ring.sq_ring_sz ) ring.sq_ring_sz = ring.cq_ring_sz;
+		ring.cq_ring_sz = ring.sq_ring_sz;
+	}
+
+	ring.sq_ring = mmap(NULL, ring.sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if ( ring.sq_ring == MAP_FAILED ) goto fail;
+
+	if ( p.features & IORING_FEAT_SINGLE_MMAP ) ring.cq_ring = ring.sq_ring;
+	else {
+		ring.cq_ring = mmap(NULL, ring.cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if ( ring.cq_ring == MAP_FAILED ) goto fail_sq;
+	}
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if ( ring.sqes == MAP_FAILED ) goto fail_cq;
+
+	unsigned char *sq = ring.sq_ring, *cq = ring.cq_ring;
+	ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	ring.entries = p.sq_entries;
+	ring.fd = fd;
+
+	return 0;
+
+fail_cq:
+	if ( ring.cq_ring != ring.sq_ring ) munmap(ring.cq_ring, ring.cq_ring_sz);
+fail_sq:
+	munmap(ring.sq_ring, ring.sq_ring_sz);
+fail:
+	perror("io_uring mmap failed");
+	close(fd);
+	return -1;
+}
+
+static void uring_free() {
+	if ( ring.fd < 0 ) return;
+
+	munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+	if ( ring.cq_ring != ring.sq_ring ) munmap(ring.cq_ring, ring.cq_ring_sz);
+	munmap(ring.sq_ring, ring.sq_ring_sz);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+/*
+ * Queues every op as a READV/WRITEV SQE, submits them with one
+ * io_uring_enter and reaps all completions, ring.entries at a time.
+ */
+static int uring_rw(struct dev_op *ops, int n) {
+	int total = 0;
+	for ( int i = 0; i < n; i++ ) total += ops[i].count;
+
+	struct iovec iov[total];
+	int retval = 0, next = 0, iov_next = 0;
+
+	while ( next < n ) {
+		unsigned tail = *ring.sq_tail, queued = 0;
+
+		while ( next < n && queued < ring.entries ) {
+			struct dev_op *op = &ops[next];
+			struct io_uring_sqe *sqe = &ring.sqes[tail & *ring.sq_mask];
+
+			for ( int i = 0; i < op->count; i++ ) {
+				iov[iov_next + i].iov_base = op->bufs[i];
+				iov[iov_next + i].iov_len = BLOCK_SIZE;
+			}
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = diskfile;
+			sqe->off = (off_t) op->block_num * BLOCK_SIZE;
+			sqe->addr = (unsigned long) &iov[iov_next];
+			sqe->len = op->count;
+			sqe->user_data = next;
+
+			ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+			tail++;
+			queued++;
+			iov_next += op->count;
+			next++;
+		}
+
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+		//The kernel may take fewer entries than offered, and then returns without waiting: the rest are offered again
+		unsigned reaped = 0, submitted = 0;
+		int busy = 0, failed = 0;
+		while ( reaped < queued ) {
+			int ret;
+			if ( busy && submitted > reaped ) ret = syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			else ret = syscall(__NR_io_uring_enter, ring.fd, queued - submitted, queued - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+			busy = 0;
+
+			if ( ret < 0 ) {
+				if ( errno == EINTR ) continue;
+				if ( errno == EAGAIN || errno == EBUSY ) {
+					busy = 1;
+					continue;
+				}
+				//Entries in flight point into iov and ops on this stack, so their completions are waited for regardless
+				if ( failed ) {
+					sched_yield();
+				} else {
+					perror("io_uring_enter failed");
+					failed = 1;
+					//Entries not taken are withdrawn, the ones in flight still complete into iov
+					__atomic_store_n(ring.sq_tail, __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+					queued = submitted;
+					next = n;
+					retval = -1;
+				}
+			} else submitted += ret;
+
+			unsigned head = *ring.cq_head;
+			while ( head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE) ) {
+				struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+				struct dev_op *op = &ops[cqe->user_data];
+
+				if ( cqe->res < 0 ) {
+					errno = -cqe->res;
+					perror(op->write ? "block_writev failed" : "block_readv failed");
+					retval = -1;
+				} else if ( ! op->write ) zero_tail(op->bufs, op->count, cqe->res);
+				else if ( cqe->res < op->count * BLOCK_SIZE ) {
+					fprintf(stderr, "block_writev failed: short write\n");
+					retval = -1;
+				}
+
+				head++;
+				reaped++;
+			}
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+		}
+	}
+
+	return retval;
+}
+
+static int dev_rw(struct dev_op *ops, int n) {
+	int writes = 0;
+	for ( int i = 0; i < n; i++ ) {
+		if ( ! ops[i].write ) continue;
+		writes = 1;
+		if ( csum_table == NULL ) break;
+		for ( int j = 0; j < ops[i].count; j++ ) csum_update(ops[i].block_num + j, ops[i].bufs[j]);
+	}
+	if ( writes ) __atomic_fetch_add(&dev_wgen, 1, __ATOMIC_SEQ_CST);
+
+	if ( ring.fd >= 0 && n > 0 ) {
+		pthread_mutex_lock(&ring_lock);
+		int retval = uring_rw(ops, n);
+		pthread_mutex_unlock(&ring_lock);
+		return retval;
+	}
+
+	for ( int i = 0; i < n; i++ ) {
+		if ( dev_rw_sync(&ops[i]) < 0 ) return -1;
+	}
+	return 0;
+}
+
+//Verifies what the read ops brought in when data blocks are checked too
+static int csum_verify_ops(struct dev_op *ops, int n) {
+	int retval = 0;
+
+	if ( ! (csum_flags & BIO_CSUM_DATA) ) return 0;
+
+	for ( int i = 0; i < n; i++ ) {
+		if ( ops[i].write ) continue;
+		for ( int j = 0; j < ops[i].count; j++ ) {
+			if ( ! csum_verify(ops[i].block_num + j, ops[i].bufs[j]) ) retval = csum_error(ops[i].block_num + j);
+		}
+	}
+
+	return retval;
+}
+
+//Switches batched and vectored transfers to an io_uring of the given depth, 0 goes back to synchronous I/O
+int bio_uring_init(int depth) {
+	uring_free();
+	if ( depth <= 0 ) return 0;
+	return uring_setup(depth);
+}
+
+/*
+ * Turns a read of bufs[0..count) starting at block_num into ops for the
+ * blocks missing from the cache (at most IOV_BATCH each), copying the
+ * cached ones straight away. Returns the number of ops written.
+ */
+static int cache_split_read(const int block_num, void **bufs, const int count, struct dev_op *ops) {
+	int n = 0;
+
+	pthread_mutex_lock(&cache_lock);
+
+	for ( int i = 0; i < count; i++ ) {
+		struct cache_buf *cb = cache_size > 0 ? cache_lookup(block_num + i) : NULL;
+		if ( cb != NULL ) {
+			cache_stats.hits++;
+			memcpy(bufs[i], cb->data, BLOCK_SIZE);
+			//Streamed data is read once, so its buffer is the first to be reused
+			if ( cb->ra ) {
+				cb->ra = 0;
+				lru_unlink(cb);
+				lru_push_tail(cb);
+			}
+			continue;
+		}
+		if ( cache_size > 0 ) cache_stats.misses++;
+
+		if ( n > 0 && ops[n - 1].block_num + ops[n - 1].count == block_num + i && ops[n - 1].count < IOV_BATCH ) {
+			ops[n - 1].count++;
+			continue;
+		}
+		ops[n].block_num = block_num + i;
+		ops[n].count = 1;
+		ops[n].bufs = &bufs[i];
+		ops[n].write = 0;
+		n++;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return n;
+}
+
+/*
+ * The write side of cache_split_read. Cached blocks take the new data and
+ * stay dirty rather than going to the disk, since a flush or an eviction
+ * may be writing an older copy of them out at this moment; only the
+ * uncached blocks become ops.
+ */
+static int cache_split_write(const int block_num, void **bufs, const int count, struct dev_op *ops) {
+	int n = 0;
+
+	pthread_mutex_lock(&cache_lock);
+
+	for ( int i = 0; i < count; i++ ) {
+		struct cache_buf *cb = cache_size > 0 ? cache_lookup(block_num + i) : NULL;
+		if ( cb != NULL ) {
+			memcpy(cb->data, bufs[i], BLOCK_SIZE);
+			cb->dirty = 1;
+			continue;
+		}
+
+		if ( n > 0 && ops[n - 1].block_num + ops[n - 1].count == block_num + i && ops[n - 1].count < IOV_BATCH ) {
+			ops[n - 1].count++;
+			continue;
+		}
+		ops[n].block_num = block_num + i;
+		ops[n].count = 1;
+		ops[n].bufs = &bufs[i];
+		ops[n].write = 1;
+		n++;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+
+	return n;
+}
+
+//Blocks loaded into the cache while they were being written may hold the old data, so they take the new
+static void cache_refresh(const int block_num, void * const bufs[], const int count) {
+	if ( cache_size == 0 ) return;
+
+	pthread_mutex_lock(&cache_lock);
+	for ( int i = 0; i < count; i++ ) {
+		struct cache_buf *cb = cache_lookup(block_num + i);
+		if ( cb != NULL ) memcpy(cb->data, bufs[i], BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Vectored I/O over count physically contiguous blocks starting at
+ * block_num, bufs[i] holding block block_num + i. Blocks already in the
+ * cache are served from (or updated in) their buffer; everything else goes
+ * to the disk with one preadv/pwritev per run and is not cached, so large
+ * transfers do not flush the metadata out of the cache.
+ */
+int bio_readv(const int block_num, void *bufs[], const int count) {
+	if ( dev_map != NULL ) {
+		for ( int i = 0; i < count; i++ ) bio_read(block_num + i, bufs[i]);
+		return count;
+	}
+
+	struct dev_op ops[count];
+	int n = cache_split_read(block_num, bufs, count, ops);
+
+	if ( dev_rw(ops, n) < 0 || csum_verify_ops(ops, n) < 0 ) return -1;
+	return count;
+}
+
+int bio_writev(const int block_num, void * const bufs[], const int count) {
+	if ( dev_map != NULL ) {
+		for ( int i = 0; i < count; i++ ) {
+			if ( bio_write(block_num + i, bufs[i]) < 0 ) return -1;
+		}
+		return count;
+	}
+
+	struct dev_op ops[count];
+	int n = cache_split_write(block_num, (void **) bufs, count, ops);
+
+	if ( dev_rw(ops, n) < 0 ) return -1;
+
+	cache_refresh(block_num, bufs, count);
+	return count;
+}
+
+/*
+ * Loads up to count blocks from block_num into the cache ahead of their
+ * use, with one transfer per uncached run and without holding cache_lock
+ * over the disk. If anything was written to the disk meanwhile, what was
+ * read may be stale and is dropped. The kernel is also told to start on
+ * the next count blocks, so the following call is mostly served from the
+ * page cache. In DEV_MMAP mode the kernel pages the range in instead.
+ * Returns the number of blocks loaded.
+ */
+int bio_readahead(const int block_num, int count) {
+	if ( dev_map != NULL ) {
+		if ( block_num < 0 || count <= 0 ) return 0;
+		if ( block_num + count > dev_nblocks ) count = dev_nblocks - block_num;
+		if ( count > 0 ) madvise(dev_map + (size_t) block_num * BLOCK_SIZE, (size_t) count * BLOCK_SIZE, MADV_WILLNEED);
+		return 0;
+	}
+
+	//Readahead never takes more than an eighth of the cache
+	if ( count > cache_size / 8 ) count = cache_size / 8;
+	if ( cache_size == 0 || count <= 0 ) return 0;
+
+	unsigned char *data = malloc((size_t) count * BLOCK_SIZE);
+	if ( data == NULL ) return 0;
+
+	void *bufs[count];
+	struct dev_op ops[count];
+	int n = 0, loaded = 0;
+
+	unsigned long wgen = __atomic_load_n(&dev_wgen, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&cache_lock);
+	for ( int i = 0; i < count; i++ ) {
+		bufs[i] = NULL;
+		if ( cache_lookup(block_num + i) != NULL ) continue;
+		bufs[i] = data + (size_t) i * BLOCK_SIZE;
+
+		if ( n > 0 && ops[n - 1].block_num + ops[n - 1].count == block_num + i && ops[n - 1].count < IOV_BATCH ) {
+			ops[n - 1].count++;
+			continue;
+		}
+		ops[n].block_num = block_num + i;
+		ops[n].count = 1;
+		ops[n].bufs = &bufs[i];
+		ops[n].write = 0;
+		n++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	posix_fadvise(diskfile, (off_t) (block_num + count) * BLOCK_SIZE, (off_t) count * BLOCK_SIZE, POSIX_FADV_WILLNEED);
+
+	if ( n > 0 && dev_rw(ops, n) == 0 ) {
+		pthread_mutex_lock(&cache_lock);
+		if ( __atomic_load_n(&dev_wgen, __ATOMIC_SEQ_CST) == wgen ) {
+			for ( int i = 0; i < count; i++ ) {
+				if ( bufs[i] == NULL || cache_lookup(block_num + i) != NULL ) continue;
+				//Left for the read that needs it to report
+				if ( ! csum_verify(block_num + i, bufs[i]) ) continue;
+				struct cache_buf *cb = cache_alloc(block_num + i);
+				if ( cb == NULL ) break;
+				memcpy(cb->data, bufs[i], BLOCK_SIZE);
+				cb->ra = 1;
+				loaded++;
+			}
+			cache_stats.readaheads += loaded;
+		}
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	free(data);
+	return loaded;
+}
+
+/*
+ * Batched I/O. Requests are only queued by bio_batch_add; bio_batch_submit
+ * hands all of them to the device at once (a single io_uring_enter when
+ * the ring is enabled) and returns when every one has completed.
+ */
+void bio_batch_init(struct bio_batch *batch) {
+	batch->nreqs = 0;
+}
+
+int bio_batch_add(struct bio_batch *batch, const int block_num, void **bufs, const int count, const int write) {
+	if ( batch->nreqs == BIO_BATCH_MAX && bio_batch_submit(batch) < 0 ) return -1;
+
+	struct bio_req *req = &batch->reqs[batch->nreqs++];
+	req->block_num = block_num;
+	req->count = count;
+	req->bufs = bufs;
+	req->write = write;
+
+	return 0;
+}
+
+int bio_batch_submit(struct bio_batch *batch) {
+	int retval = 0, total = 0;
+
+	if ( dev_map != NULL ) {
+		for ( int i = 0; i < batch->nreqs; i++ ) {
+			struct bio_req *req = &batch->reqs[i];
+			if ( (req->write ? bio_writev(req->block_num, req->bufs, req->count) : bio_readv(req->block_num, req->bufs, req->count)) < 0 ) retval = -1;
+		}
+		batch->nreqs = 0;
+		return retval;
+	}
+
+	for ( int i = 0; i < batch->nreqs; i++ ) total += batch->reqs[i].count;
+	if ( total == 0 ) {
+		batch->nreqs = 0;
+		return 0;
+	}
+
+	struct dev_op ops[total];
+	int n = 0;
+
+	for ( int i = 0; i < batch->nreqs; i++ ) {
+		struct bio_req *req = &batch->reqs[i];
+		if ( req->write ) n += cache_split_write(req->block_num, req->bufs, req->count, ops + n);
+		else n += cache_split_read(req->block_num, req->bufs, req->count, ops + n);
+	}
+
+	retval = dev_rw(ops, n);
+	if ( retval == 0 ) retval = csum_verify_ops(ops, n);
+
+	for ( int i = 0; i < batch->nreqs; i++ ) {
+		struct bio_req *req = &batch->reqs[i];
+		if ( req->write ) cache_refresh(req->block_num, req->bufs, req->count);
+	}
+
+	batch->nreqs = 0;
+	return retval;
+}
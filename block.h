@@ -10,10 +10,68 @@
 
 #define BLOCK_SIZE 4096
 
-void dev_init(const char* diskfile_path);
+/* device backends */
+#define DEV_PIO		0				/* pread/pwrite through the block cache */
+#define DEV_MMAP	1				/* whole disk file mapped, msync on flush */
+
+/* default number of buffers in the block cache (16MB) */
+#define BIO_CACHE_BLOCKS 4096
+/* bio_get pins buffers, so the cache never shrinks below this */
+#define BIO_MIN_CACHE_BLOCKS 64
+
+/* checksum table: one CRC32C per block, BIO_CSUM_PER_BLOCK to a table block */
+#define BIO_CSUM_PER_BLOCK	(BLOCK_SIZE / 4)
+#define BIO_CSUM_META		1			/* verify blocks read into the cache */
+#define BIO_CSUM_DATA		2			/* verify vectored and batched reads too */
+
+/* default io_uring queue depth */
+#define BIO_URING_DEPTH 64
+/* requests queued by bio_batch_add before it submits on its own */
+#define BIO_BATCH_MAX 32
+
+struct bio_req {
+	int		block_num;					/* first of count contiguous blocks */
+	int		count;
+	void	**bufs;						/* one BLOCK_SIZE buffer per block */
+	int		write;
+};
+
+struct bio_batch {
+	int				nreqs;
+	struct bio_req	reqs[BIO_BATCH_MAX];
+};
+
+struct bio_cache_stats {
+	unsigned long	hits;				/* bio_read served from the cache */
+	unsigned long	misses;				/* bio_read that went to the disk */
+	unsigned long	evictions;			/* buffers recycled for another block */
+	unsigned long	writebacks;			/* dirty buffers written to the disk */
+	unsigned long	readaheads;			/* blocks loaded by bio_readahead */
+	unsigned long	csum_errors;		/* reads failed for a checksum mismatch */
+};
+
+void dev_init(const char* diskfile_path, const int nblocks);
 int dev_open(const char* diskfile_path);
 void dev_close();
+void dev_set_mode(int mode);
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int block_num, void *bufs[], const int count);
+int bio_writev(const int block_num, void * const bufs[], const int count);
+
+int bio_cache_init(int nblocks);
+int bio_flush();
+void bio_cache_stats(struct bio_cache_stats *stats);
+int bio_readahead(const int block_num, int count);
+int bio_csum_init(int start_blk, int nblocks, int fresh, int flags);
+
+int bio_uring_init(int depth);
+void bio_batch_init(struct bio_batch *batch);
+int bio_batch_add(struct bio_batch *batch, const int block_num, void **bufs, const int count, const int write);
+int bio_batch_submit(struct bio_batch *batch);
+
+void *bio_get(const int block_num);
+void bio_dirty(const void *data);
+void bio_put(const void *data);
 
 #endif
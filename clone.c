@@ -0,0 +1,121 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	clone.c
+ *
+ *	clone.rufs [-s src_offset] [-l length] [-d dest_offset] source dest
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <limits.h>
+
+#include "rufs.h"
+
+static void usage() {
+	fprintf(stderr, "usage: clone.rufs [-s src_offset] [-l length] [-d dest_offset] source dest\n");
+	exit(EXIT_FAILURE);
+}
+
+// A non-negative decimal offset or length, the ioctl checks alignment
+static uint64_t number(const char *arg) {
+
+	char *end;
+	errno = 0;
+	long long value = strtoll(arg, &end, 10);
+	if ( *arg == '\0' || *end != '\0' || value < 0 || errno != 0 ) usage();
+
+	return value;
+}
+
+// The ioctl names the source from the mount's root, so walk up from it while still on the same device
+static int mount_path(const char *source, dev_t *dev, char *src_path) {
+
+	char real[PATH_MAX], root[PATH_MAX];
+	if ( realpath(source, real) == NULL ) return -1;
+
+	struct stat st;
+	if ( stat(real, &st) < 0 ) return -1;
+	*(dev) = st.st_dev;
+
+	strcpy(root, real);
+	while ( strcmp(root, "/") != 0 ) {
+		char parent[PATH_MAX];
+		strcpy(parent, root);
+		char *up = dirname(parent);
+		if ( stat(up, &st) < 0 ) return -1;
+		if ( st.st_dev != *(dev) ) break;
+		strcpy(root, up);
+	}
+
+	size_t skip = strcmp(root, "/") == 0 ? 0 : strlen(root);
+	snprintf(src_path, PATH_MAX, "%s", real[skip] == '\0' ? "/" : real + skip);
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+	struct rufs_clone_range range;
+	memset(&range, 0, sizeof(range));
+
+	int opt;
+	while ( (opt = getopt(argc, argv, "s:l:d:")) != -1 ) {
+		switch ( opt ) {
+			case 's': range.src_offset = number(optarg); break;
+			case 'l': range.length = number(optarg); break;
+			case 'd': range.dest_offset = number(optarg); break;
+			default: usage();
+		}
+	}
+	if ( optind != argc - 2 ) usage();
+
+	const char *source = argv[optind], *dest = argv[optind + 1];
+
+	dev_t dev;
+	if ( mount_path(source, &dev, range.src_path) < 0 ) {
+		perror(source);
+		return EXIT_FAILURE;
+	}
+
+	// Checked on the directory first so a dest on another mount is not left behind created
+	char dir[PATH_MAX];
+	struct stat st;
+	snprintf(dir, PATH_MAX, "%s", dest);
+	if ( stat(dirname(dir), &st) == 0 && st.st_dev != dev ) {
+		fprintf(stderr, "clone.rufs: %s and %s are not on the same rufs mount\n", source, dest);
+		return EXIT_FAILURE;
+	}
+
+	int fd = open(dest, O_WRONLY | O_CREAT, 0644);
+	if ( fd < 0 ) {
+		perror(dest);
+		return EXIT_FAILURE;
+	}
+
+	if ( fstat(fd, &st) < 0 || st.st_dev != dev ) {
+		fprintf(stderr, "clone.rufs: %s and %s are not on the same rufs mount\n", source, dest);
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	if ( ioctl(fd, RUFS_IOC_CLONE_RANGE, &range) < 0 ) {
+		perror("clone.rufs: RUFS_IOC_CLONE_RANGE");
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	if ( close(fd) < 0 ) {
+		perror(dest);
+		return EXIT_FAILURE;
+	}
+
+	return 0;
+}
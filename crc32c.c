@@ -0,0 +1,90 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	crc32c.c
+ *
+ *	The SSE4.2 crc32 instruction where the CPU has it, table driven
+ *	slicing-by-8 otherwise. Both give the same results.
+ *
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "crc32c.h"
+
+#define CRC32C_POLY 0x82F63B78		/* reversed Castagnoli polynomial */
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc_impl)(uint32_t, const uint8_t *, size_t);
+
+// crc_table[k][b] is the CRC of byte b followed by k zero bytes
+static void crc32c_tables() {
+
+	for ( int b = 0; b < 256; b++ ) {
+		uint32_t crc = b;
+		for ( int i = 0; i < 8; i++ ) crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		crc_table[0][b] = crc;
+	}
+
+	for ( int b = 0; b < 256; b++ ) {
+		for ( int k = 1; k < 8; k++ ) crc_table[k][b] = (crc_table[k - 1][b] >> 8) ^ crc_table[0][crc_table[k - 1][b] & 0xff];
+	}
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+
+	for ( ; len > 0 && ((uintptr_t) p & 7); len-- ) crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+
+	for ( ; len >= 8; len -= 8, p += 8 ) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = crc_table[7][v & 0xff] ^ crc_table[6][(v >> 8) & 0xff] ^ crc_table[5][(v >> 16) & 0xff] ^ crc_table[4][(v >> 24) & 0xff] ^
+			crc_table[3][(v >> 32) & 0xff] ^ crc_table[2][(v >> 40) & 0xff] ^ crc_table[1][(v >> 48) & 0xff] ^ crc_table[0][v >> 56];
+	}
+
+	for ( ; len > 0; len-- ) crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+
+	uint64_t c = crc;
+
+	for ( ; len > 0 && ((uintptr_t) p & 7); len-- ) c = __builtin_ia32_crc32qi(c, *p++);
+
+	for ( ; len >= 8; len -= 8, p += 8 ) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		c = __builtin_ia32_crc32di(c, v);
+	}
+
+	for ( ; len > 0; len-- ) c = __builtin_ia32_crc32qi(c, *p++);
+
+	return c;
+}
+
+#endif
+
+static void crc32c_setup() {
+
+	crc32c_tables();
+	crc_impl = crc32c_sw;
+
+#if defined(__x86_64__)
+	if ( __builtin_cpu_supports("sse4.2") ) crc_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+
+	pthread_once(&crc_once, crc32c_setup);
+
+	return ~crc_impl(~crc, buf, len);
+}
@@ -0,0 +1,17 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	crc32c.h
+ *
+ */
+
+#ifndef _CRC32C_H_
+#define _CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32C (Castagnoli) of len bytes of buf, continuing from crc (0 to start) */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
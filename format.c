@@ -0,0 +1,157 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	format.c
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+
+#include "block.h"
+#include "rufs.h"
+
+// Lays out the first dirent block of a directory, holding "." and ".."
+void dir_init_leaf(void *block, uint32_t ino, uint32_t parent_ino) {
+
+	struct dirent *dot = block;
+	struct dirent *dotdot = (struct dirent *) ((char *) block + DIRENT_REC_LEN(1));
+
+	memset(block, 0, BLOCK_SIZE);
+
+	dot->ino = ino;
+	dot->rec_len = DIRENT_REC_LEN(1);
+	dot->name_len = 1;
+	dot->type = IS_DIRECTORY;
+	memcpy(dot->name, ".", 1);
+
+	dotdot->ino = parent_ino;
+	dotdot->rec_len = BLOCK_SIZE - DIRENT_REC_LEN(1);
+	dotdot->name_len = 2;
+	dotdot->type = IS_DIRECTORY;
+	memcpy(dotdot->name, "..", 2);
+}
+
+/*
+ * Creates a new image at diskfile_path and leaves the device open. Only
+ * the superblock, the first block of each bitmap, the first inode table
+ * block and the root directory are written, in one batch; everything
+ * else, the inode, checksum and reference count tables included, is left
+ * as the holes dev_init makes, which read back as zeros. The cost is the
+ * same at any geometry. inodes <= 0 picks one inode per
+ * DEFAULT_BLOCKS_PER_INODE blocks. The new superblock is copied to sb if
+ * it is not NULL.
+ */
+int rufs_format(const char *diskfile_path, int size_mb, int inodes, struct superblock *sb) {
+
+	// Block numbers are ints everywhere, less a bitmap block of headroom for the round-ups below
+	int max_mb = (INT_MAX - BITS_PER_BLOCK) / (1024 * 1024 / BLOCK_SIZE);
+	if ( size_mb <= 0 || size_mb > max_mb ) {
+		fprintf(stderr, "rufs: image size must be 1 to %d MiB\n", max_mb);
+		return -EINVAL;
+	}
+
+	int nblocks = size_mb * (1024 * 1024 / BLOCK_SIZE);
+	if ( inodes <= 0 ) inodes = nblocks / DEFAULT_BLOCKS_PER_INODE;
+
+	// More inodes than there are blocks to hold their table is never going to fit, and would overflow below
+	if ( inodes / (int) INODE_PER_BLOCK >= nblocks || inodes > INT_MAX - BITS_PER_BLOCK ) {
+		fprintf(stderr, "rufs: a %d MiB image cannot hold %d inodes\n", size_mb, inodes);
+		return -ENOSPC;
+	}
+
+	// Bitmaps are searched a word at a time, so both maps cover a multiple of 64
+	inodes = (inodes + 63) / 64 * 64;
+
+	int blocks_for_i_bitmap = (inodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+	int blocks_for_d_bitmap = (nblocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+	int blocks_for_inodes = inodes / INODE_PER_BLOCK;
+	int blocks_for_csums = (nblocks + BIO_CSUM_PER_BLOCK - 1) / BIO_CSUM_PER_BLOCK;
+	int blocks_for_refs = (nblocks + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+
+	// Summed wide, a table of nearly nblocks inodes plus the rest can still pass INT_MAX
+	int64_t d_start_blk = 1 + (int64_t) blocks_for_i_bitmap + blocks_for_d_bitmap + blocks_for_inodes + blocks_for_csums + blocks_for_refs;
+	if ( nblocks < d_start_blk + 64 ) {
+		fprintf(stderr, "rufs: a %d MiB image cannot hold %d inodes\n", size_mb, inodes);
+		return -ENOSPC;
+	}
+
+	static unsigned char blocks[6][BLOCK_SIZE];
+	memset(blocks, 0, sizeof(blocks));
+
+	struct superblock *superblock = (struct superblock *) blocks[0];
+	bitmap_t i_bitmap = blocks[1], d_bitmap = blocks[2];
+	struct inode *inode_table = (struct inode *) blocks[3];
+	struct dx_root *root_index = (struct dx_root *) blocks[4];
+
+	superblock->magic_num = MAGIC_NUM;
+	superblock->max_inum = inodes;
+	superblock->max_dnum = (nblocks - d_start_blk) / 64 * 64;
+	superblock->nblocks = nblocks;
+
+	superblock->i_bitmap_blk = 1;
+	superblock->d_bitmap_blk = superblock->i_bitmap_blk + blocks_for_i_bitmap;
+	superblock->i_start_blk = superblock->d_bitmap_blk + blocks_for_d_bitmap;
+	superblock->c_start_blk = superblock->i_start_blk + blocks_for_inodes;
+	superblock->r_start_blk = superblock->c_start_blk + blocks_for_csums;
+	superblock->d_start_blk = superblock->r_start_blk + blocks_for_refs;
+	superblock->free_inodes = superblock->max_inum - 1;
+	superblock->free_blocks = superblock->max_dnum - 2;
+
+	// An all-zero table knows no checksums yet, which is true of every block
+	superblock->flags = SB_CSUM_VALID;
+
+	// The root directory is inode 0 with the first two data blocks, its index and its dirent block
+	set_bitmap(i_bitmap, ROOT_DIRECTORY_INO);
+	set_bitmap(d_bitmap, 0);
+	set_bitmap(d_bitmap, 1);
+
+	struct inode *root_ino = &inode_table[ROOT_DIRECTORY_INO];
+
+	root_ino->ino = ROOT_DIRECTORY_INO;
+	root_ino->type = IS_DIRECTORY;
+	root_ino->valid = VALID;
+	root_ino->link = 2;
+	root_ino->direct_ptr[0] = superblock->d_start_blk;
+	root_ino->direct_ptr[1] = superblock->d_start_blk + 1;
+	root_ino->size = 2;
+
+	root_ino->ctime = time(NULL);
+	root_ino->atime = time(NULL);
+	root_ino->mtime = time(NULL);
+	root_ino->uid = getuid();
+	root_ino->gid = getgid();
+	root_ino->mode = __S_IFDIR | 0755;
+	root_ino->bytes = DIRENT_REC_LEN(1) + DIRENT_REC_LEN(2);
+
+	root_index->count = 1;
+	root_index->entries[0].hash = 0;
+	root_index->entries[0].block = 1;
+
+	dir_init_leaf(blocks[5], ROOT_DIRECTORY_INO, ROOT_DIRECTORY_INO);
+
+	dev_init(diskfile_path, nblocks);
+
+	int blknos[6] = { SUPERBLOCK_BLKNO, superblock->i_bitmap_blk, superblock->d_bitmap_blk, superblock->i_start_blk, superblock->d_start_blk, superblock->d_start_blk + 1 };
+	void *bufs[6];
+
+	struct bio_batch batch;
+	bio_batch_init(&batch);
+
+	for ( int i = 0; i < 6; i++ ) {
+		bufs[i] = blocks[i];
+		if ( bio_batch_add(&batch, blknos[i], &bufs[i], 1, 1) < 0 ) return -EIO;
+	}
+
+	if ( bio_batch_submit(&batch) < 0 ) return -EIO;
+
+	if ( sb != NULL ) *(sb) = *(superblock);
+
+	return 0;
+}
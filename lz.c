@@ -0,0 +1,158 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	lz.c
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static uint32_t lz_read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned lz_hash(uint32_t v) {
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Lengths past a nibble continue in bytes of 255, ended by one below 255
+static uint8_t *lz_put_len(uint8_t *op, size_t len) {
+
+	for ( ; len >= 255; len -= 255 ) *op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+static int lz_get_len(const uint8_t **ipp, const uint8_t *iend, size_t *len) {
+
+	const uint8_t *ip = *ipp;
+	uint8_t b;
+
+	do {
+		if ( ip == iend ) return -1;
+		b = *ip++;
+		*(len) += b;
+	} while ( b == 255 );
+
+	*(ipp) = ip;
+
+	return 0;
+}
+
+// Appends one sequence, mlen 0 for the final literals-only one
+static int lz_sequence(uint8_t **opp, uint8_t *oend, const uint8_t *lit, size_t nlit, size_t offset, size_t mlen) {
+
+	uint8_t *op = *opp;
+	size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+	if ( (size_t) (oend - op) < 1 + nlit / 255 + 1 + nlit + 2 + ml / 255 + 1 ) return -1;
+
+	uint8_t *token = op++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if ( nlit >= 15 ) op = lz_put_len(op, nlit - 15);
+
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if ( mlen ) {
+		*token |= ml < 15 ? ml : 15;
+		op[0] = offset & 0xff;
+		op[1] = offset >> 8;
+		op += 2;
+		if ( ml >= 15 ) op = lz_put_len(op, ml - 15);
+	}
+
+	*(opp) = op;
+
+	return 0;
+}
+
+// Greedy parse, each position remembered in a hash table of its next four bytes
+int lz_compress(const void *src, int len, void *dst, int cap) {
+
+	const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len;
+	uint8_t *op = dst, *oend = op + cap;
+	int table[1 << LZ_HASH_BITS];
+
+	if ( len > LZ_MAX_INPUT ) return 0;
+
+	for ( int i = 0; i < (1 << LZ_HASH_BITS); i++ ) table[i] = -1;
+
+	while ( end - ip >= LZ_MIN_MATCH ) {
+
+		uint32_t v = lz_read32(ip);
+		unsigned h = lz_hash(v);
+		int cand = table[h];
+		table[h] = ip - in;
+
+		if ( cand < 0 || (ip - in) - cand > LZ_MAX_OFFSET || lz_read32(in + cand) != v ) {
+			ip++;
+			continue;
+		}
+
+		const uint8_t *match = in + cand;
+		size_t mlen = LZ_MIN_MATCH;
+		while ( ip + mlen < end && ip[mlen] == match[mlen] ) mlen++;
+
+		if ( lz_sequence(&op, oend, anchor, ip - anchor, ip - match, mlen) != 0 ) return 0;
+
+		ip += mlen;
+		anchor = ip;
+
+	}
+
+	if ( lz_sequence(&op, oend, anchor, end - anchor, 0, 0) != 0 ) return 0;
+
+	return op - (uint8_t *) dst;
+}
+
+int lz_decompress(const void *src, int len, void *dst, int cap) {
+
+	const uint8_t *ip = src, *iend = ip + len;
+	uint8_t *ostart = dst, *op = ostart, *oend = op + cap;
+
+	while ( ip < iend ) {
+
+		unsigned token = *ip++;
+
+		size_t nlit = token >> 4;
+		if ( nlit == 15 && lz_get_len(&ip, iend, &nlit) != 0 ) return -1;
+		if ( (size_t) (iend - ip) < nlit || (size_t) (oend - op) < nlit ) return -1;
+
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		if ( ip == iend ) break;
+		if ( iend - ip < 2 ) return -1;
+
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t mlen = token & 15;
+		if ( mlen == 15 && lz_get_len(&ip, iend, &mlen) != 0 ) return -1;
+		mlen += LZ_MIN_MATCH;
+
+		if ( offset == 0 || offset > (size_t) (op - ostart) || mlen > (size_t) (oend - op) ) return -1;
+
+		// A match may overlap what it produces, which then repeats with period offset
+		const uint8_t *match = op - offset;
+		if ( offset >= mlen ) memcpy(op, match, mlen);
+		else for ( size_t i = 0; i < mlen; i++ ) op[i] = match[i];
+		op += mlen;
+
+	}
+
+	return op - ostart;
+}
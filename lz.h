@@ -0,0 +1,26 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	lz.h
+ *
+ */
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+/*
+ * A small LZ77 codec in the style of LZ4: each sequence is a token byte
+ * (literal count in the high nibble, match length - 4 in the low one),
+ * the literals, a 16-bit little-endian match offset and any length bytes
+ * that did not fit the nibbles. The last sequence has literals only.
+ * Inputs are at most 64 KiB so every offset fits 16 bits.
+ */
+
+#define LZ_MAX_INPUT 65536
+
+/* compresses len bytes of src into at most cap bytes of dst; 0 if they do not fit */
+int lz_compress(const void *src, int len, void *dst, int cap);
+/* expands len bytes of src into at most cap bytes of dst; -1 on a corrupt stream */
+int lz_decompress(const void *src, int len, void *dst, int cap);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	mkfs.c
+ *
+ *	mkfs.rufs [-s size_mb] [-i inodes] image
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+
+#include "block.h"
+#include "rufs.h"
+
+static void usage() {
+	fprintf(stderr, "usage: mkfs.rufs [-s size_mb] [-i inodes] image\n");
+	exit(EXIT_FAILURE);
+}
+
+// A non-negative decimal that fits an int, rufs_format checks the rest
+static int number(const char *arg) {
+
+	char *end;
+	long value = strtol(arg, &end, 10);
+	if ( *arg == '\0' || *end != '\0' || value < 0 || value > INT_MAX ) usage();
+
+	return value;
+}
+
+int main(int argc, char *argv[]) {
+
+	int size_mb = DEFAULT_DISK_SIZE / (1024 * 1024), inodes = 0, opt;
+
+	while ( (opt = getopt(argc, argv, "s:i:")) != -1 ) {
+		switch ( opt ) {
+			case 's': size_mb = number(optarg); break;
+			case 'i': inodes = number(optarg); break;
+			default: usage();
+		}
+	}
+	if ( optind != argc - 1 ) usage();
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct superblock sb;
+	if ( rufs_format(argv[optind], size_mb, inodes, &sb) != 0 ) return EXIT_FAILURE;
+	dev_close();
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+	printf("%s: %u blocks, %u inodes, %u data blocks in %.3f ms\n", argv[optind], sb.nblocks, sb.max_inum, sb.max_dnum, ms);
+
+	return 0;
+}
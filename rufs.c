@@ -6,17 +6,26 @@
  */
 
 #define FUSE_USE_VERSION 26
-#define SUPERBLOCK_BLKNO 0
-#define ROOT_DIRECTORY_INO 0
 
-#define IS_FILE 0
-#define IS_DIRECTORY 1
+#define DX_ENTRIES_PER_BLOCK ((BLOCK_SIZE - sizeof(struct dx_root)) / (sizeof(struct dx_entry)))
+#define DIR_INDEX_BLOCK 0
 
-#define INVALID 0
-#define VALID 1
+#define DIRECT_PTRS 12
+#define SINGLE_INDIRECT_PTRS 7
+#define PTRS_PER_BLOCK ((int) (BLOCK_SIZE / sizeof(int)))
+#define MAX_FILE_BLOCKS (DIRECT_PTRS + SINGLE_INDIRECT_PTRS * PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK)
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
 
-#define INODE_PER_BLOCK ((BLOCK_SIZE) / (sizeof(struct inode)))
-#define DIRENT_PER_BLOCK ((BLOCK_SIZE) / (sizeof(struct dirent)))
+#define ICACHE_SIZE 1024
+
+#define WB_SIZE (32 * BLOCK_SIZE)
+#define WB_MAX_SIZE (256 * BLOCK_SIZE)
+#define RA_MIN_BLOCKS 16
+#define RA_MAX_BLOCKS 256
+
+#define DCACHE_SIZE 4096
+#define DCACHE_LOCKS 64
+#define DCACHE_NAME_LEN 64
 
 #include <fuse.h>
 #include <stdlib.h>
@@ -30,670 +39,2809 @@
 #include <sys/stat.h>
 #include <libgen.h>
 #include <limits.h>
+#include <linux/falloc.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <endian.h>
 
 #include "block.h"
 #include "rufs.h"
+#include "lz.h"
+#include "crc32c.h"
+
+char diskfile_path[PATH_MAX];
+
+struct rufs_config {
+	int cache_blocks;				/* buffers in the block cache, raised to BIO_MIN_CACHE_BLOCKS */
+	int mmap;						/* use the DEV_MMAP device backend */
+	int io_uring;					/* submit batched I/O through io_uring */
+	int size_mb;					/* size of a new image */
+	int inodes;						/* inodes in a new image, 0 to scale with its size */
+	int compress;					/* files created from now on store their data compressed */
+	int csum;						/* BIO_CSUM_* flags, 0 for no checksums */
+	int dedup;						/* blocks written to plain files share identical stored ones */
+};
+
+struct rufs_config rufs_conf = {
+	.cache_blocks = BIO_CACHE_BLOCKS,
+	.size_mb = DEFAULT_DISK_SIZE / (1024 * 1024),
+};
+
+#define RUFS_OPT(t, p, v) { t, offsetof(struct rufs_config, p), v }
+
+static struct fuse_opt rufs_opts[] = {
+	RUFS_OPT("cache_blocks=%d", cache_blocks, 0),
+	RUFS_OPT("mmap", mmap, 1),
+	RUFS_OPT("io_uring", io_uring, 1),
+	RUFS_OPT("size=%d", size_mb, 0),
+	RUFS_OPT("inodes=%d", inodes, 0),
+	RUFS_OPT("compress", compress, 1),
+	RUFS_OPT("csum", csum, BIO_CSUM_META),
+	RUFS_OPT("csum=data", csum, BIO_CSUM_META | BIO_CSUM_DATA),
+	RUFS_OPT("dedup", dedup, 1),
+	FUSE_OPT_END
+};
+
+/* the superblock stays pinned in place (bio_get) while mounted */
+struct superblock *superblock_ptr = NULL;
+
+
+/*
+ * Every inode has a reader/writer lock, held (for writing if anything
+ * changes) while its inode and blocks are in use. A path walk only holds
+ * each directory's lock for its own lookup. The bitmaps are guarded by
+ * alloc_lock, which may be taken with an inode lock held but not the
+ * other way round.
+ */
+pthread_rwlock_t *inode_locks = NULL;
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ilock(uint32_t ino, int write) {
+	if ( write ) pthread_rwlock_wrlock(&inode_locks[ino]);
+	else pthread_rwlock_rdlock(&inode_locks[ino]);
+}
+
+static void iunlock(uint32_t ino) {
+	pthread_rwlock_unlock(&inode_locks[ino]);
+}
+
+/*
+ * Allocation state for one bitmap, spread over as many blocks as the
+ * geometry needs. A free count per bitmap block lets full blocks be
+ * skipped without reading them and a full map fail at once. Within a
+ * block the search goes 64 bits at a time, resuming from the last
+ * allocation. Bitmap blocks are ordinary cached metadata, so a bit flip
+ * only marks its block dirty for the next flush. The total is mirrored
+ * into the superblock, where statfs reads it without taking alloc_lock.
+ */
+struct alloc_map {
+	int start_blk;					/* first bitmap block */
+	int nbits;						/* a multiple of 64 */
+	int nblocks;
+	int *free;						/* clear bits in each bitmap block */
+	int nfree;
+	int hint;						/* bit the next search starts from */
+	uint32_t *summary;				/* free count in the superblock */
+};
+
+struct alloc_map inode_map, block_map;
+
+static uint64_t bitmap_word(bitmap_t map, int w) {
+	uint64_t word;
+	memcpy(&word, map + w * sizeof(word), sizeof(word));
+	return le64toh(word);
+}
+
+static int alloc_map_bits(struct alloc_map *am, int b) {
+	return (am->nbits - b * BITS_PER_BLOCK < BITS_PER_BLOCK) ? am->nbits - b * BITS_PER_BLOCK : BITS_PER_BLOCK;
+}
+
+static void alloc_map_count(struct alloc_map *am, int delta) {
+	am->nfree += delta;
+	__atomic_store_n(am->summary, am->nfree, __ATOMIC_RELAXED);
+	bio_dirty(superblock_ptr);
+}
+
+// Counts the clear bits of every bitmap block, which also brings the superblock's count up to date
+static int alloc_map_init(struct alloc_map *am, int start_blk, int nbits, uint32_t *summary) {
+
+	am->summary = summary;
+	am->start_blk = start_blk;
+	am->nbits = nbits;
+	am->nblocks = (nbits + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+	am->nfree = 0;
+	am->hint = 0;
+
+	free(am->free);
+	am->free = malloc(am->nblocks * sizeof(int));
+	if ( am->free == NULL ) return -ENOMEM;
+
+	for ( int b = 0; b < am->nblocks; b++ ) {
+
+		bitmap_t map = bio_get(start_blk + b);
+		if ( map == NULL ) return -EIO;
+
+		am->free[b] = alloc_map_bits(am, b);
+		for ( int w = 0; w < alloc_map_bits(am, b) / 64; w++ ) am->free[b] -= __builtin_popcountll(bitmap_word(map, w));
+		am->nfree += am->free[b];
+
+		bio_put(map);
+
+	}
+
+	alloc_map_count(am, 0);
+
+	return 0;
+}
+
+static void alloc_map_free(struct alloc_map *am) {
+	free(am->free);
+	am->free = NULL;
+}
+
+static int alloc_map_claim(struct alloc_map *am, bitmap_t map, int bit) {
+
+	set_bitmap(map, bit % BITS_PER_BLOCK);
+	bio_dirty(map);
+	bio_put(map);
+
+	am->free[bit / BITS_PER_BLOCK]--;
+	alloc_map_count(am, -1);
+	am->hint = bit;
+
+	return bit;
+}
+
+// Claims a clear bit, goal itself if it is free, with alloc_lock held
+static int alloc_map_get(struct alloc_map *am, int goal) {
+
+	if ( am->nfree == 0 ) return -1;
+
+	if ( goal >= 0 && goal < am->nbits && am->free[goal / BITS_PER_BLOCK] > 0 ) {
+		bitmap_t map = bio_get(am->start_blk + goal / BITS_PER_BLOCK);
+		if ( map == NULL ) return -1;
+		if ( ! get_bitmap(map, goal % BITS_PER_BLOCK) ) return alloc_map_claim(am, map, goal);
+		bio_put(map);
+	}
+
+	// The hint's block comes round again at the end to cover the words before the hint
+	int first = am->hint / BITS_PER_BLOCK;
+
+	for ( int n = 0; n <= am->nblocks; n++ ) {
+
+		int b = (first + n) % am->nblocks;
+		if ( am->free[b] == 0 ) continue;
+
+		bitmap_t map = bio_get(am->start_blk + b);
+		if ( map == NULL ) return -1;
+
+		for ( int w = (n == 0) ? (am->hint % BITS_PER_BLOCK) / 64 : 0; w < alloc_map_bits(am, b) / 64; w++ ) {
+			uint64_t word = bitmap_word(map, w);
+			if ( word != ~0ULL ) return alloc_map_claim(am, map, b * BITS_PER_BLOCK + w * 64 + __builtin_ctzll(~word));
+		}
+
+		bio_put(map);
+
+	}
+
+	return -1;
+}
+
+// The clear bits from bit on in a bitmap block of bits bits, counting no further than want
+static int alloc_map_run(bitmap_t map, int bit, int bits, int want) {
+
+	int len = 0;
+	while ( bit + len < bits && len < want && ! get_bitmap(map, bit + len) ) len++;
+
+	return len;
+}
+
+/*
+ * Claims up to want clear bits in a row in one go, with alloc_lock held,
+ * and returns the first with their number in *got. A run starting at goal
+ * is taken if there is one; otherwise the first run of want bits from the
+ * hint's block on, or failing that the longest there is. Runs stay within
+ * one bitmap block.
+ */
+static int alloc_map_get_run(struct alloc_map *am, int goal, int want, int *got) {
+
+	if ( am->nfree == 0 ) return -1;
+
+	int best = -1, best_len = 0;
+
+	if ( goal >= 0 && goal < am->nbits && am->free[goal / BITS_PER_BLOCK] > 0 ) {
+		bitmap_t map = bio_get(am->start_blk + goal / BITS_PER_BLOCK);
+		if ( map == NULL ) return -1;
+		best_len = alloc_map_run(map, goal % BITS_PER_BLOCK, alloc_map_bits(am, goal / BITS_PER_BLOCK), want);
+		if ( best_len > 0 ) best = goal;
+		bio_put(map);
+	}
+
+	int first = am->hint / BITS_PER_BLOCK, at_goal = best != -1;
+
+	for ( int n = 0; n < am->nblocks && ! at_goal && best_len < want; n++ ) {
+
+		int b = (first + n) % am->nblocks;
+		if ( am->free[b] == 0 ) continue;
+
+		bitmap_t map = bio_get(am->start_blk + b);
+		if ( map == NULL ) return -1;
+
+		for ( int i = 0; i < alloc_map_bits(am, b) && best_len < want; ) {
+			if ( i % 64 == 0 && bitmap_word(map, i / 64) == ~0ULL ) {
+				i += 64;
+				continue;
+			}
+			if ( get_bitmap(map, i) ) {
+				i++;
+				continue;
+			}
+			int len = alloc_map_run(map, i, alloc_map_bits(am, b), want);
+			if ( len > best_len ) {
+				best = b * BITS_PER_BLOCK + i;
+				best_len = len;
+			}
+			i += len;
+		}
+
+		bio_put(map);
+
+	}
+
+	if ( best == -1 ) return -1;
+
+	bitmap_t map = bio_get(am->start_blk + best / BITS_PER_BLOCK);
+	if ( map == NULL ) return -1;
+
+	for ( int i = 0; i < best_len; i++ ) set_bitmap(map, (best + i) % BITS_PER_BLOCK);
+	bio_dirty(map);
+	bio_put(map);
+
+	am->free[best / BITS_PER_BLOCK] -= best_len;
+	alloc_map_count(am, -best_len);
+	am->hint = best + best_len;
+
+	*(got) = best_len;
+
+	return best;
+}
+
+static void alloc_map_put(struct alloc_map *am, int bit) {
+
+	bitmap_t map = bio_get(am->start_blk + bit / BITS_PER_BLOCK);
+	if ( map == NULL ) return;
+
+	if ( get_bitmap(map, bit % BITS_PER_BLOCK) ) {
+		unset_bitmap(map, bit % BITS_PER_BLOCK);
+		bio_dirty(map);
+		am->free[bit / BITS_PER_BLOCK]++;
+		alloc_map_count(am, 1);
+	}
+
+	bio_put(map);
+
+}
+
+/*
+ * Dentry cache: a direct-mapped table of (parent ino, name) -> ino, where
+ * a negative entry records that the name does not exist. Entries are
+ * filled by lookups under the parent's read lock and updated by dir_add
+ * and dir_remove under its write lock, so they never go stale. Names
+ * longer than DCACHE_NAME_LEN are not cached.
+ */
+struct dcache_entry {
+	uint32_t	parent;
+	uint32_t	ino;
+	uint8_t		valid;
+	uint8_t		negative;
+	uint16_t	len;
+	char		name[DCACHE_NAME_LEN];
+};
+
+struct dcache_entry dcache[DCACHE_SIZE];
+pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+
+static uint32_t dcache_hash(uint32_t parent, const char *name, size_t len) {
+	uint32_t h = 2166136261u ^ parent;
+	for ( size_t i = 0; i < len; i++ ) h = (h ^ (unsigned char) name[i]) * 16777619u;
+	return h & (DCACHE_SIZE - 1);
+}
+
+static void dcache_init() {
+	memset(dcache, 0, sizeof(dcache));
+	for ( int i = 0; i < DCACHE_LOCKS; i++ ) pthread_mutex_init(&dcache_locks[i], NULL);
+}
+
+// Returns 0 and the ino on a hit, -ENOENT on a negative hit, 1 on a miss
+static int dcache_lookup(uint32_t parent, const char *name, size_t len, uint32_t *ino) {
+
+	if ( len > DCACHE_NAME_LEN ) return 1;
+
+	uint32_t slot = dcache_hash(parent, name, len);
+	struct dcache_entry *de = &dcache[slot];
+	int retval = 1;
+
+	pthread_mutex_lock(&dcache_locks[slot % DCACHE_LOCKS]);
+	if ( de->valid && de->parent == parent && de->len == len && memcmp(de->name, name, len) == 0 ) {
+		if ( de->negative ) retval = -ENOENT;
+		else {
+			*ino = de->ino;
+			retval = 0;
+		}
+	}
+	pthread_mutex_unlock(&dcache_locks[slot % DCACHE_LOCKS]);
+
+	return retval;
+}
+
+static void dcache_insert(uint32_t parent, const char *name, size_t len, uint32_t ino, int negative) {
+
+	if ( len > DCACHE_NAME_LEN ) return;
+
+	uint32_t slot = dcache_hash(parent, name, len);
+	struct dcache_entry *de = &dcache[slot];
+
+	pthread_mutex_lock(&dcache_locks[slot % DCACHE_LOCKS]);
+	de->valid = VALID;
+	de->parent = parent;
+	de->ino = ino;
+	de->negative = negative;
+	de->len = len;
+	memcpy(de->name, name, len);
+	pthread_mutex_unlock(&dcache_locks[slot % DCACHE_LOCKS]);
+
+}
+
+static void dcache_remove(uint32_t parent, const char *name, size_t len) {
+
+	if ( len > DCACHE_NAME_LEN ) return;
+
+	uint32_t slot = dcache_hash(parent, name, len);
+	struct dcache_entry *de = &dcache[slot];
+
+	pthread_mutex_lock(&dcache_locks[slot % DCACHE_LOCKS]);
+	if ( de->valid && de->parent == parent && de->len == len && memcmp(de->name, name, len) == 0 ) de->valid = INVALID;
+	pthread_mutex_unlock(&dcache_locks[slot % DCACHE_LOCKS]);
+
+}
+
+int get_avail_ino() {
+
+	pthread_mutex_lock(&alloc_lock);
+	int ino = alloc_map_get(&inode_map, -1);
+	pthread_mutex_unlock(&alloc_lock);
+
+	return ino;
+}
+
+/*
+ * Blocks promised to data buffered by open files, which has none until it
+ * is flushed (see struct file_handle). Allocations leave that many free,
+ * except that a thread flushing buffered data draws on the handle's share
+ * through block_draw, so a flush cannot run out of space for want of
+ * blocks someone else took. Guarded by alloc_lock.
+ */
+int block_resv;
+static __thread int *block_draw;
+
+// Blocks an allocation may take, with alloc_lock held
+static int blocks_avail() {
+	return block_map.nfree - block_resv + ((block_draw != NULL) ? *(block_draw) : 0);
+}
+
+// Settles n blocks just allocated against the reservation being drawn on, with alloc_lock held
+static void blocks_drawn(int n) {
+
+	if ( block_draw == NULL ) return;
+
+	if ( n > *(block_draw) ) n = *(block_draw);
+	*(block_draw) -= n;
+	block_resv -= n;
+
+}
+
+// Reserves n more blocks, all or none; a negative n gives blocks back
+static int block_reserve(int n) {
+
+	int retval = 0;
+
+	pthread_mutex_lock(&alloc_lock);
+	if ( n > 0 && block_map.nfree - block_resv < n ) retval = -ENOSPC;
+	else block_resv += n;
+	pthread_mutex_unlock(&alloc_lock);
+
+	return retval;
+}
+
+// Allocates goal if it is free, so that a file growing block by block stays contiguous
+static int get_blkno_near(int goal) {
+
+	pthread_mutex_lock(&alloc_lock);
+	int blkno = (blocks_avail() > 0) ? alloc_map_get(&block_map, goal - (int) superblock_ptr->d_start_blk) : -1;
+	if ( blkno != -1 ) blocks_drawn(1);
+	pthread_mutex_unlock(&alloc_lock);
+
+	if ( blkno == -1 ) return -1;
+
+	return blkno + superblock_ptr->d_start_blk;
+}
+
+int get_avail_blkno() {
+	return get_blkno_near(-1);
+}
+
+// Allocates up to want contiguous blocks in one go, from goal on if it is free; returns the first and how many in *got
+static int get_blkno_run(int goal, int want, int *got) {
+
+	pthread_mutex_lock(&alloc_lock);
+	int avail = blocks_avail();
+	int blkno = (avail > 0) ? alloc_map_get_run(&block_map, goal - (int) superblock_ptr->d_start_blk, (want < avail) ? want : avail, got) : -1;
+	if ( blkno != -1 ) blocks_drawn(*(got));
+	pthread_mutex_unlock(&alloc_lock);
+
+	if ( blkno == -1 ) return -1;
+
+	return blkno + superblock_ptr->d_start_blk;
+}
+
+void release_ino(int ino) {
+
+	pthread_mutex_lock(&alloc_lock);
+	alloc_map_put(&inode_map, ino);
+	pthread_mutex_unlock(&alloc_lock);
+
+}
+
+/*
+ * Shared blocks. A data block may be mapped more than once, by one file or
+ * several; the reference count table holds the mappings beyond the first,
+ * so the zeroed table of a new image says nothing is shared. A shared
+ * block is never written in place, the writer gets a copy of its own
+ * first, and release_blkno drops one mapping, freeing the block with the
+ * last. The table is cached metadata like the bitmaps, under alloc_lock.
+ *
+ * With -o dedup, blocks written to plain files are also entered in an
+ * in-memory index on their CRC32C, and a block whose contents are stored
+ * already maps that copy instead. Any indexed block may gain a mapping at
+ * any time, so it counts as shared too. Only blocks written since mount
+ * are indexed.
+ */
+struct dedup_index {
+	int *head;						/* hash buckets of data block numbers, -1 ended */
+	int *next;						/* chain link of each data block */
+	uint32_t *crc;
+	unsigned char *indexed;
+	int mask;
+};
+
+struct dedup_index dedup;
+
+// Adds delta to the extra mappings of data block d and returns them, with alloc_lock held
+static int block_refs(int d, int delta) {
+
+	uint32_t *refs = bio_get(superblock_ptr->r_start_blk + d / REFS_PER_BLOCK);
+	if ( refs == NULL ) return -1;
+
+	refs[d % REFS_PER_BLOCK] += delta;
+	int count = refs[d % REFS_PER_BLOCK];
+	if ( delta != 0 ) bio_dirty(refs);
+
+	bio_put(refs);
+
+	return count;
+}
+
+static int dedup_init(int nblocks) {
+
+	int buckets = 1;
+	while ( buckets < nblocks ) buckets <<= 1;
+
+	dedup.head = malloc(buckets * sizeof(int));
+	dedup.next = malloc(nblocks * sizeof(int));
+	dedup.crc = malloc(nblocks * sizeof(uint32_t));
+	dedup.indexed = calloc(nblocks, 1);
+	if ( dedup.head == NULL || dedup.next == NULL || dedup.crc == NULL || dedup.indexed == NULL ) return -ENOMEM;
+
+	for ( int i = 0; i < buckets; i++ ) dedup.head[i] = -1;
+	dedup.mask = buckets - 1;
+
+	return 0;
+}
+
+static void dedup_free() {
+	free(dedup.head);
+	free(dedup.next);
+	free(dedup.crc);
+	free(dedup.indexed);
+	memset(&dedup, 0, sizeof(dedup));
+}
+
+static void dedup_remove(int d) {
+
+	if ( dedup.indexed == NULL || ! dedup.indexed[d] ) return;
+
+	int *pp = &dedup.head[dedup.crc[d] & dedup.mask];
+	while ( *pp != d ) pp = &dedup.next[*pp];
+	*pp = dedup.next[d];
+
+	dedup.indexed[d] = 0;
+}
+
+static void dedup_insert(int d, uint32_t crc) {
+
+	dedup_remove(d);
+
+	dedup.crc[d] = crc;
+	dedup.next[d] = dedup.head[crc & dedup.mask];
+	dedup.head[crc & dedup.mask] = d;
+	dedup.indexed[d] = 1;
+}
+
+// A mapping of a stored block with this CRC other than blkno, -1 if there is none
+static int dedup_claim(uint32_t crc, int blkno) {
+
+	int found = -1;
+
+	pthread_mutex_lock(&alloc_lock);
+
+	for ( int d = dedup.head[crc & dedup.mask]; d != -1; d = dedup.next[d] ) {
+		if ( dedup.crc[d] != crc || d + (int) superblock_ptr->d_start_blk == blkno ) continue;
+		if ( block_refs(d, 1) > 0 ) found = d + superblock_ptr->d_start_blk;
+		break;
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+	return found;
+}
+
+// Enters blkno, which now holds data with this CRC, in the index
+static void dedup_add(int blkno, uint32_t crc) {
+
+	pthread_mutex_lock(&alloc_lock);
+	dedup_insert(blkno - superblock_ptr->d_start_blk, crc);
+	pthread_mutex_unlock(&alloc_lock);
+
+}
+
+// Adds a mapping of blkno, for a file that is to share it
+static int block_share(int blkno) {
+
+	pthread_mutex_lock(&alloc_lock);
+	int refs = block_refs(blkno - superblock_ptr->d_start_blk, 1);
+	pthread_mutex_unlock(&alloc_lock);
+
+	return (refs < 0) ? -EIO : 0;
+}
+
+// Whether blkno may be mapped elsewhere, in which case it must not be written in place
+static int block_shared(int blkno) {
+
+	int d = blkno - superblock_ptr->d_start_blk;
+
+	pthread_mutex_lock(&alloc_lock);
+	int shared = (dedup.indexed != NULL && dedup.indexed[d]) || block_refs(d, 0) != 0;
+	pthread_mutex_unlock(&alloc_lock);
+
+	return shared;
+}
+
+void release_blkno(int blkno) {
+
+	int d = blkno - superblock_ptr->d_start_blk;
+
+	pthread_mutex_lock(&alloc_lock);
+
+	// A block whose count cannot be read is leaked rather than freed while it may still be mapped
+	int refs = block_refs(d, 0);
+	if ( refs > 0 ) block_refs(d, -1);
+	else if ( refs == 0 ) {
+		dedup_remove(d);
+		alloc_map_put(&block_map, d);
+	}
+
+	pthread_mutex_unlock(&alloc_lock);
+
+}
+
+/*
+ * Inode cache. Inodes are used in memory: iget pins one (loading it from
+ * the inode table on a miss), the caller works on it in place under the
+ * inode's lock and reports changes with idirty, and iput drops the pin.
+ * Dirty inodes reach the inode table on isync, which packs every dirty
+ * inode of a table block into one update of that block, or when an
+ * unpinned entry is evicted. When every entry is pinned, by open files
+ * say, the cache grows past ICACHE_SIZE instead of failing, and keeps the
+ * entries it added until the next mount.
+ */
+struct file_handle;
+
+struct icache_entry {
+	struct inode		inode;
+	int					ino;		/* cached inode number, -1 if unused */
+	int					refs;		/* outstanding iget references */
+	int					dirty;
+	struct file_handle	*wb;		/* handle holding write-behind data, under the inode lock */
+	struct icache_entry	*hnext;		/* hash chain */
+	struct icache_entry	*prev;		/* LRU list */
+	struct icache_entry	*next;
+	struct icache_entry	*more;		/* entries added past ICACHE_SIZE */
+};
+
+struct icache_entry icache[ICACHE_SIZE], *icache_hash[ICACHE_SIZE], icache_lru, *icache_more;
+int icache_count;
+pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void icache_init() {
+	while ( icache_more != NULL ) {
+		struct icache_entry *e = icache_more;
+		icache_more = e->more;
+		free(e);
+	}
+	icache_count = ICACHE_SIZE;
+
+	memset(icache_hash, 0, sizeof(icache_hash));
+	icache_lru.next = icache_lru.prev = &icache_lru;
+	for ( int i = 0; i < ICACHE_SIZE; i++ ) {
+		icache[i].ino = -1;
+		icache[i].next = icache_lru.next;
+		icache[i].prev = &icache_lru;
+		icache_lru.next->prev = &icache[i];
+		icache_lru.next = &icache[i];
+	}
+}
+
+static struct icache_entry *icache_lookup(int ino) {
+	struct icache_entry *e = icache_hash[ino % ICACHE_SIZE];
+	while ( e != NULL && e->ino != ino ) e = e->hnext;
+	return e;
+}
+
+static struct icache_entry *icache_of(struct inode *inode) {
+	return (struct icache_entry *) ((char *) inode - offsetof(struct icache_entry, inode));
+}
+
+static int inode_blkno(uint32_t ino) {
+	return (ino / INODE_PER_BLOCK) + superblock_ptr->i_start_blk;
+}
+
+/*
+ * Writes e, and every other dirty unpinned inode of its table block, back
+ * to the block. Unpinned inodes cannot be changing, so this is safe with
+ * just icache_lock held.
+ */
+static int icache_writeback(struct icache_entry *e) {
+
+	int blkno = inode_blkno(e->ino);
+	int first = e->ino - (e->ino % INODE_PER_BLOCK);
+
+	struct inode *inode_ptr = bio_get(blkno);
+	if ( inode_ptr == NULL ) return -EIO;
+
+	for ( int i = 0; i < INODE_PER_BLOCK; i++ ) {
+		struct icache_entry *other = icache_lookup(first + i);
+		if ( other != NULL && other->dirty && (other->refs == 0 || other == e) ) {
+			inode_ptr[i] = other->inode;
+			other->dirty = 0;
+		}
+	}
+
+	bio_dirty(inode_ptr);
+	bio_put(inode_ptr);
+
+	return 0;
+}
+
+struct inode *iget(uint32_t ino) {
+
+	pthread_mutex_lock(&icache_lock);
+
+	struct icache_entry *e = icache_lookup(ino);
+
+	if ( e == NULL ) {
+
+		e = icache_lru.prev;
+		while ( e != &icache_lru && e->refs > 0 ) e = e->prev;
+		if ( e == &icache_lru ) {
+			e = calloc(1, sizeof(struct icache_entry));
+			if ( e == NULL ) {
+				pthread_mutex_unlock(&icache_lock);
+				fprintf(stderr, "rufs: inode cache exhausted\n");
+				return NULL;
+			}
+			e->ino = -1;
+			e->more = icache_more;
+			icache_more = e;
+			icache_count++;
+			e->next = icache_lru.next;
+			e->prev = &icache_lru;
+			icache_lru.next->prev = e;
+			icache_lru.next = e;
+		}
+
+		if ( e->ino >= 0 ) {
+			if ( e->dirty && icache_writeback(e) != 0 ) {
+				pthread_mutex_unlock(&icache_lock);
+				return NULL;
+			}
+			struct icache_entry **pp = &icache_hash[e->ino % ICACHE_SIZE];
+			while ( *pp != e ) pp = &(*pp)->hnext;
+			*pp = e->hnext;
+		}
+
+		struct inode *inode_ptr = bio_get(inode_blkno(ino));
+		if ( inode_ptr == NULL ) {
+			e->ino = -1;
+			pthread_mutex_unlock(&icache_lock);
+			return NULL;
+		}
+		e->inode = inode_ptr[ino % INODE_PER_BLOCK];
+		bio_put(inode_ptr);
+
+		e->ino = ino;
+		e->dirty = 0;
+		e->wb = NULL;
+		e->hnext = icache_hash[ino % ICACHE_SIZE];
+		icache_hash[ino % ICACHE_SIZE] = e;
+
+	}
+
+	e->refs++;
+
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	e->next = icache_lru.next;
+	e->prev = &icache_lru;
+	icache_lru.next->prev = e;
+	icache_lru.next = e;
+
+	pthread_mutex_unlock(&icache_lock);
+
+	return &e->inode;
+}
+
+void iput(struct inode *inode) {
+	pthread_mutex_lock(&icache_lock);
+	icache_of(inode)->refs--;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+void idirty(struct inode *inode) {
+	pthread_mutex_lock(&icache_lock);
+	icache_of(inode)->dirty = 1;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+static int cmp_icache_ino(const void *a, const void *b) {
+	return (*(struct icache_entry **) a)->ino - (*(struct icache_entry **) b)->ino;
+}
+
+// Writes every dirty inode back to the inode table, one block update per table block
+int isync() {
+
+	int count = 0, retval = 0;
+
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry **dirty = malloc(icache_count * sizeof(struct icache_entry *));
+	if ( dirty == NULL ) {
+		pthread_mutex_unlock(&icache_lock);
+		return -ENOMEM;
+	}
+	for ( struct icache_entry *e = icache_lru.next; e != &icache_lru; e = e->next ) {
+		if ( e->ino >= 0 && e->dirty ) {
+			e->refs++;
+			dirty[count++] = e;
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	qsort(dirty, count, sizeof(struct icache_entry *), cmp_icache_ino);
+
+	for ( int i = 0; i < count; ) {
+
+		int blkno = inode_blkno(dirty[i]->ino);
+
+		struct inode *inode_ptr = bio_get(blkno);
+		if ( inode_ptr == NULL ) {
+			retval = -EIO;
+			break;
+		}
+
+		// The inode lock keeps everyone out while the copy is taken (readers still update atime), and the dirty bit is cleared first so a later change is not lost
+		for ( ; i < count && inode_blkno(dirty[i]->ino) == blkno; i++ ) {
+			ilock(dirty[i]->ino, 1);
+			pthread_mutex_lock(&icache_lock);
+			dirty[i]->dirty = 0;
+			pthread_mutex_unlock(&icache_lock);
+			inode_ptr[dirty[i]->ino % INODE_PER_BLOCK] = dirty[i]->inode;
+			iunlock(dirty[i]->ino);
+		}
+
+		bio_dirty(inode_ptr);
+		bio_put(inode_ptr);
+
+	}
+
+	pthread_mutex_lock(&icache_lock);
+	for ( int i = 0; i < count; i++ ) dirty[i]->refs--;
+	pthread_mutex_unlock(&icache_lock);
+
+	free(dirty);
+
+	return retval;
+}
+
+int readi(uint32_t ino, struct inode *inode) {
+
+	struct inode *cached = iget(ino);
+	if ( cached == NULL ) return -EIO;
+
+	*(inode) = *(cached);
+
+	iput(cached);
+
+	return 0;
+}
+
+int writei(uint32_t ino, struct inode *inode) {
+
+	struct inode *cached = iget(ino);
+	if ( cached == NULL ) return -EIO;
+
+	*(cached) = *(inode);
+
+	idirty(cached);
+	iput(cached);
+
+	return 0;
+}
+
+// Updates just the atime, safe with only a read lock held on ino
+int itouch(uint32_t ino) {
+
+	struct inode *cached = iget(ino);
+	if ( cached == NULL ) return -EIO;
+
+	__atomic_store_n(&cached->atime, time(NULL), __ATOMIC_RELAXED);
+
+	idirty(cached);
+	iput(cached);
+
+	return 0;
+}
+
+// Gives up an inode that was written but never linked, so no valid copy of it outlives its number
+void ifree(uint32_t ino) {
+
+	struct inode *cached = iget(ino);
+	if ( cached != NULL ) {
+		memset(cached, 0, sizeof(*cached));
+		idirty(cached);
+		iput(cached);
+	}
+
+	release_ino(ino);
+
+}
+
+/*
+ * Block mapping. Logical blocks 0 to size - 1 of an inode are always
+ * allocated: the first DIRECT_PTRS are in direct_ptr, the next go through
+ * the single indirect blocks and the rest through the double indirect one.
+ * Compressed files are the exception, their clusters can map holes. A
+ * negative pointer is a block fallocate reserved that has not been written
+ * yet, which reads as zeros. Callers hold the inode's lock.
+ */
+static int bmap(struct inode *inode, int lblk, int count, int *blknos) {
+
+	int i = 0;
+
+	while ( i < count ) {
+
+		int l = lblk + i;
+
+		if ( l < DIRECT_PTRS ) {
+			blknos[i++] = inode->direct_ptr[l];
+			continue;
+		}
+
+		l -= DIRECT_PTRS;
+
+		int table;
+		if ( l < SINGLE_INDIRECT_PTRS * PTRS_PER_BLOCK ) table = inode->indirect_ptr[l / PTRS_PER_BLOCK];
+		else {
+			l -= SINGLE_INDIRECT_PTRS * PTRS_PER_BLOCK;
+			int *dind = bio_get(inode->indirect_ptr[SINGLE_INDIRECT_PTRS]);
+			if ( dind == NULL ) return -EIO;
+			table = dind[l / PTRS_PER_BLOCK];
+			bio_put(dind);
+		}
+
+		int *ptrs = bio_get(table);
+		if ( ptrs == NULL ) return -EIO;
+
+		// Take every pointer this table holds for the range in one go
+		int n = PTRS_PER_BLOCK - l % PTRS_PER_BLOCK;
+		if ( n > count - i ) n = count - i;
+		memcpy(&blknos[i], &ptrs[l % PTRS_PER_BLOCK], n * sizeof(int));
+		i += n;
+
+		bio_put(ptrs);
+
+	}
+
+	return 0;
+}
+
+// Replaces the pointer of logical block lblk, which must already be mapped
+static int bmap_set(struct inode *inode, int lblk, int blkno) {
+
+	if ( lblk < DIRECT_PTRS ) {
+		inode->direct_ptr[lblk] = blkno;
+		return 0;
+	}
+
+	int l = lblk - DIRECT_PTRS, table;
+
+	if ( l < SINGLE_INDIRECT_PTRS * PTRS_PER_BLOCK ) table = inode->indirect_ptr[l / PTRS_PER_BLOCK];
+	else {
+		l -= SINGLE_INDIRECT_PTRS * PTRS_PER_BLOCK;
+		int *dind = bio_get(inode->indirect_ptr[SINGLE_INDIRECT_PTRS]);
+		if ( dind == NULL ) return -EIO;
+		table = dind[l / PTRS_PER_BLOCK];
+		bio_put(dind);
+	}
+
+	int *ptrs = bio_get(table);
+	if ( ptrs == NULL ) return -EIO;
+
+	ptrs[l % PTRS_PER_BLOCK] = blkno;
+	bio_dirty(ptrs);
+	bio_put(ptrs);
+
+	return 0;
+}
+
+// Allocates a zeroed pointer block and stores its number in *ref
+static int bmap_new_table(int *ref, int goal) {
+
+	int blkno = get_blkno_near(goal);
+	if ( blkno == -1 ) return -ENOSPC;
+
+	int *ptrs = bio_get(blkno);
+	if ( ptrs == NULL ) {
+		release_blkno(blkno);
+		return -EIO;
+	}
+
+	memset(ptrs, 0, BLOCK_SIZE);
+	bio_dirty(ptrs);
+	bio_put(ptrs);
+
+	*(ref) = blkno;
+
+	return 0;
+}
+
+// Maps blkno as logical block size of the inode, adding pointer blocks as needed
+static int bmap_append(struct inode *inode, int blkno) {
+
+	int l = inode->size;
+
+	if ( l >= MAX_FILE_BLOCKS ) return -EFBIG;
+
+	if ( l < DIRECT_PTRS ) {
+		inode->direct_ptr[l] = blkno;
+		inode->size++;
+		return 0;
+	}
+
+	l -= DIRECT_PTRS;
+
+	int retval = 0, *dind = NULL, *table_ref;
+
+	if ( l < SINGLE_INDIRECT_PTRS * PTRS_PER_BLOCK ) table_ref = &inode->indirect_ptr[l / PTRS_PER_BLOCK];
+	else {
+		l -= SINGLE_INDIRECT_PTRS * PTRS_PER_BLOCK;
+
+		if ( l == 0 ) {
+			retval = bmap_new_table(&inode->indirect_ptr[SINGLE_INDIRECT_PTRS], abs(blkno) + 1);
+			if ( retval != 0 ) return retval;
+		}
+
+		dind = bio_get(inode->indirect_ptr[SINGLE_INDIRECT_PTRS]);
+		if ( dind == NULL ) return -EIO;
+		table_ref = &dind[l / PTRS_PER_BLOCK];
+	}
+
+	if ( l % PTRS_PER_BLOCK == 0 ) {
+		retval = bmap_new_table(table_ref, abs(blkno) + 1);
+		if ( retval == 0 && dind != NULL ) bio_dirty(dind);
+	}
+
+	int table = *table_ref;
+	if ( dind != NULL ) bio_put(dind);
+
+	if ( retval != 0 ) {
+		if ( dind != NULL && l == 0 ) {
+			release_blkno(inode->indirect_ptr[SINGLE_INDIRECT_PTRS]);
+			inode->indirect_ptr[SINGLE_INDIRECT_PTRS] = 0;
+		}
+		return retval;
+	}
+
+	int *ptrs = bio_get(table);
+	if ( ptrs == NULL ) return -EIO;
+
+	ptrs[l % PTRS_PER_BLOCK] = blkno;
+	bio_dirty(ptrs);
+	bio_put(ptrs);
+
+	inode->size++;
+
+	return 0;
+}
+
+static uint32_t dx_hash(const char *fname, size_t name_len) {
+	uint32_t h = 2166136261u;
+	for ( size_t i = 0; i < name_len; i++ ) h = (h ^ (unsigned char) fname[i]) * 16777619u;
+	return h;
+}
+
+static int dir_block(struct inode *dir_inode, int lblk) {
+
+	int blkno;
+	if ( bmap(dir_inode, lblk, 1, &blkno) != 0 ) return -1;
+
+	return blkno;
+}
+
+// Index of the entry whose dirent block covers hash
+static int dx_search(struct dx_root *root, uint32_t hash) {
+
+	int lo = 0, hi = root->count - 1;
+
+	while ( lo < hi ) {
+		int mid = (lo + hi + 1) / 2;
+		if ( root->entries[mid].hash <= hash ) lo = mid;
+		else hi = mid - 1;
+	}
+
+	return lo;
+}
+
+// Offset of the record after the one at off; a corrupt rec_len ends the walk
+static int dirent_next(char *block, int off) {
+
+	int rec_len = ((struct dirent *) (block + off))->rec_len;
+	if ( rec_len < DIRENT_REC_LEN(0) || off + rec_len > BLOCK_SIZE ) return BLOCK_SIZE;
+
+	return off + rec_len;
+}
+
+// Offset of the record a name_len entry can be carved from, or -1 if the block is full
+static int dirent_room(char *block, size_t name_len) {
+
+	int need = DIRENT_REC_LEN(name_len);
+
+	for ( int off = 0; off < BLOCK_SIZE; off = dirent_next(block, off) ) {
+		struct dirent *d = (struct dirent *) (block + off);
+		int used = d->name_len ? DIRENT_REC_LEN(d->name_len) : 0;
+		if ( d->rec_len - used >= need ) return off;
+	}
+
+	return -1;
+}
+
+// Fills the record at off, first splitting its slack off into a record of its own if it is in use
+static void dirent_insert(char *block, int off, uint32_t ino, const char *fname, size_t name_len, uint8_t type) {
+
+	struct dirent *d = (struct dirent *) (block + off);
+
+	if ( d->name_len ) {
+		int used = DIRENT_REC_LEN(d->name_len);
+		struct dirent *slack = (struct dirent *) (block + off + used);
+		slack->rec_len = d->rec_len - used;
+		d->rec_len = used;
+		d = slack;
+	}
+
+	d->ino = ino;
+	d->name_len = name_len;
+	d->type = type;
+	memcpy(d->name, fname, name_len);
+}
+
+// Allocates the index and first dirent block of a new directory, holding "." and ".."
+static int dir_init_blocks(struct inode *dir_inode, uint32_t parent_ino) {
+
+	int index_blkno = get_avail_blkno();
+	if ( index_blkno == -1 ) return -ENOSPC;
+
+	int leaf_blkno = get_avail_blkno();
+	if ( leaf_blkno == -1 ) {
+		release_blkno(index_blkno);
+		return -ENOSPC;
+	}
+
+	struct dx_root *root = bio_get(index_blkno);
+	char *leaf = bio_get(leaf_blkno);
+	if ( root == NULL || leaf == NULL ) {
+		if ( root != NULL ) bio_put(root);
+		if ( leaf != NULL ) bio_put(leaf);
+		release_blkno(leaf_blkno);
+		release_blkno(index_blkno);
+		return -EIO;
+	}
+
+	memset(root, 0, BLOCK_SIZE);
+	root->count = 1;
+	root->entries[0].hash = 0;
+	root->entries[0].block = 1;
+
+	bio_dirty(root);
+	bio_put(root);
+
+	dir_init_leaf(leaf, dir_inode->ino, parent_ino);
+
+	bio_dirty(leaf);
+	bio_put(leaf);
+
+	dir_inode->direct_ptr[0] = index_blkno;
+	dir_inode->direct_ptr[1] = leaf_blkno;
+	dir_inode->size = 2;
+
+	return 0;
+}
+
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+
+	struct inode dir_ino;
+	int retval = readi(ino, &dir_ino);
+	if ( retval != 0 ) return retval;
+
+	if ( dir_ino.type != IS_DIRECTORY ) return -ENOTDIR;
+	if ( name_len > DIRENT_NAME_MAX ) return -ENAMETOOLONG;
+
+	struct dx_root *root = bio_get(dir_block(&dir_ino, DIR_INDEX_BLOCK));
+	if ( root == NULL ) return -EIO;
+
+	int leaf = root->entries[dx_search(root, dx_hash(fname, name_len))].block;
+
+	bio_put(root);
+
+	char *block = bio_get(dir_block(&dir_ino, leaf));
+	if ( block == NULL ) return -EIO;
+
+	for ( int off = 0; off < BLOCK_SIZE; off = dirent_next(block, off) ) {
+
+		struct dirent *d = (struct dirent *) (block + off);
+
+		// Only the fixed part is copied out, callers that need the name already have it
+		if ( (d->name_len == name_len) && (memcmp(fname, d->name, name_len) == 0) ) {
+			*(dirent) = *(d);
+			bio_put(block);
+			return 0;
+		}
+
+	}
+
+	bio_put(block);
+
+	return -ENOENT;
+
+}
+
+/*
+ * Splits the dirent block *leaf, covered by index entry *idx, at a hash
+ * boundary near its middle. The records with the upper hashes move to a
+ * new block with its own index entry, both blocks are repacked, and
+ * *leaf and *idx become whichever block now covers hash.
+ */
+static int dx_split(struct inode *dir_inode, struct dx_root *root, int *idx, char **leaf, uint32_t hash) {
+
+	// A full index means the directory cannot take another entry
+	if ( root->count == DX_ENTRIES_PER_BLOCK ) return -ENOSPC;
+
+	char *old_leaf = *leaf;
+	int offs[BLOCK_SIZE / DIRENT_REC_LEN(1)], n = 0;
+	uint32_t hashes[BLOCK_SIZE / DIRENT_REC_LEN(1)], sorted[BLOCK_SIZE / DIRENT_REC_LEN(1)];
+
+	for ( int off = 0; off < BLOCK_SIZE; off = dirent_next(old_leaf, off) ) {
+		struct dirent *d = (struct dirent *) (old_leaf + off);
+		if ( d->name_len == 0 ) continue;
+		offs[n] = off;
+		hashes[n] = dx_hash(d->name, d->name_len);
+		int k = n;
+		while ( k > 0 && sorted[k - 1] > hashes[n] ) {
+			sorted[k] = sorted[k - 1];
+			k--;
+		}
+		sorted[k] = hashes[n];
+		n++;
+	}
+	if ( n < 2 ) return -ENOSPC;
+
+	// Names with equal hashes must stay together, so split at the hash change closest to the middle
+	uint32_t split = 0;
+	for ( int d = 0; d <= n / 2 && split == 0; d++ ) {
+		int mid = n / 2;
+		if ( mid + d < n && sorted[mid + d - 1] != sorted[mid + d] ) split = sorted[mid + d];
+		else if ( mid - d > 0 && sorted[mid - d - 1] != sorted[mid - d] ) split = sorted[mid - d];
+	}
+	if ( split == 0 ) return -ENOSPC;
+
+	int blkno = get_avail_blkno();
+	if ( blkno == -1 ) return -ENOSPC;
+
+	char *new_leaf = bio_get(blkno);
+	if ( new_leaf == NULL ) {
+		release_blkno(blkno);
+		return -EIO;
+	}
+
+	int lblk = dir_inode->size;
+	int retval = bmap_append(dir_inode, blkno);
+	if ( retval != 0 ) {
+		bio_put(new_leaf);
+		release_blkno(blkno);
+		return retval;
+	}
+
+	char old_copy[BLOCK_SIZE];
+	memcpy(old_copy, old_leaf, BLOCK_SIZE);
+
+	memset(old_leaf, 0, BLOCK_SIZE);
+	memset(new_leaf, 0, BLOCK_SIZE);
+	((struct dirent *) old_leaf)->rec_len = BLOCK_SIZE;
+	((struct dirent *) new_leaf)->rec_len = BLOCK_SIZE;
+
+	for ( int j = 0; j < n; j++ ) {
+		struct dirent *d = (struct dirent *) (old_copy + offs[j]);
+		char *dst = hashes[j] >= split ? new_leaf : old_leaf;
+		dirent_insert(dst, dirent_room(dst, d->name_len), d->ino, d->name, d->name_len, d->type);
+	}
+
+	memmove(&root->entries[*(idx) + 2], &root->entries[*(idx) + 1], (root->count - *(idx) - 1) * sizeof(struct dx_entry));
+	root->entries[*(idx) + 1].hash = split;
+	root->entries[*(idx) + 1].block = lblk;
+	root->count++;
+
+	bio_dirty(root);
+	bio_dirty(old_leaf);
+	bio_dirty(new_leaf);
+
+	if ( hash >= split ) {
+		bio_put(old_leaf);
+		*(leaf) = new_leaf;
+		(*idx)++;
+	} else bio_put(new_leaf);
+
+	return 0;
+}
+
+int dir_add(struct inode dir_inode, uint32_t f_ino, uint8_t type, const char *fname, size_t name_len) {
+
+	if ( name_len > DIRENT_NAME_MAX ) return -ENAMETOOLONG;
+
+	uint32_t hash = dx_hash(fname, name_len);
+
+	// Pinned first, so nothing can fail once the entry is in
+	struct inode *cached = iget(dir_inode.ino);
+	if ( cached == NULL ) return -EIO;
+
+	struct dx_root *root = bio_get(dir_block(&dir_inode, DIR_INDEX_BLOCK));
+	if ( root == NULL ) {
+		iput(cached);
+		return -EIO;
+	}
+
+	int idx = dx_search(root, hash);
+
+	char *block = bio_get(dir_block(&dir_inode, root->entries[idx].block));
+	if ( block == NULL ) {
+		bio_put(root);
+		iput(cached);
+		return -EIO;
+	}
+
+	// A name can only live in the block its hash maps to, so that one block settles EEXIST and where to insert
+	for ( int off = 0; off < BLOCK_SIZE; off = dirent_next(block, off) ) {
+
+		struct dirent *d = (struct dirent *) (block + off);
+
+		if ( (d->name_len == name_len) && (memcmp(fname, d->name, name_len) == 0) ) {
+			bio_put(block);
+			bio_put(root);
+			iput(cached);
+			return -EEXIST;
+		}
+
+	}
+
+	// Every split leaves fewer records in the block hash maps to, so this ends
+	int off;
+	while ( (off = dirent_room(block, name_len)) == -1 ) {
+
+		int retval = dx_split(&dir_inode, root, &idx, &block, hash);
+		if ( retval != 0 ) {
+			// Splits already made are complete, and the blocks they added stay mapped
+			*(cached) = dir_inode;
+			idirty(cached);
+			iput(cached);
+			bio_put(block);
+			bio_put(root);
+			return retval;
+		}
+
+	}
+
+	dirent_insert(block, off, f_ino, fname, name_len, type);
+
+	bio_dirty(block);
+	bio_put(block);
+	bio_put(root);
+
+	dir_inode.bytes += DIRENT_REC_LEN(name_len);
+	dir_inode.atime = time(NULL);
+	dir_inode.mtime = time(NULL);
+
+	*(cached) = dir_inode;
+	idirty(cached);
+	iput(cached);
+
+	dcache_insert(dir_inode.ino, fname, name_len, f_ino, 0);
+
+	return 0;
+}
+
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+	dcache_remove(dir_inode.ino, fname, name_len);
+	return 0;
+}
+
+// Resolves one path component in directory ino, whose lock the caller holds
+static int dir_lookup(uint32_t ino, const char *fname, size_t name_len, uint32_t *f_ino) {
+
+	int retval = dcache_lookup(ino, fname, name_len, f_ino);
+	if ( retval <= 0 ) return retval;
+
+	struct dirent dirent;
+	retval = dir_find(ino, fname, name_len, &dirent);
+
+	if ( retval == 0 ) {
+		*(f_ino) = dirent.ino;
+		dcache_insert(ino, fname, name_len, dirent.ino, 0);
+	} else if ( retval == -ENOENT ) dcache_insert(ino, fname, name_len, 0, 1);
+
+	return retval;
+}
+
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode) {
+
+	const char *name = strchr(path, '/');
+	if ( name == NULL ) return -ENOENT;
+	name++;
+
+	while ( *name != '\0' ) {
+
+		const char *end = strchr(name, '/');
+		size_t name_len = (end == NULL) ? strlen(name) : (size_t) (end - name);
+		if ( name_len == 0 ) return -ENOENT;
+
+		uint32_t next;
+		ilock(ino, 0);
+		int retval = dir_lookup(ino, name, name_len, &next);
+		iunlock(ino);
+		if ( retval != 0 ) return retval;
+
+		ino = next;
+		name += name_len;
+		if ( *name == '/' ) name++;
+
+	}
+
+	ilock(ino, 0);
+	int retval = readi(ino, inode);
+	iunlock(ino);
+
+	return retval;
+}
+
+static void *rufs_init(struct fuse_conn_info *conn) {
+
+	// The cache cannot be turned off: bio_get pins its buffers
+	if ( ! rufs_conf.mmap && rufs_conf.cache_blocks < BIO_MIN_CACHE_BLOCKS ) {
+		fprintf(stderr, "rufs: cache_blocks=%d raised to %d\n", rufs_conf.cache_blocks, BIO_MIN_CACHE_BLOCKS);
+		rufs_conf.cache_blocks = BIO_MIN_CACHE_BLOCKS;
+	}
+
+	if ( rufs_conf.mmap ) dev_set_mode(DEV_MMAP);
+	else if ( bio_cache_init(rufs_conf.cache_blocks) != 0 ) fprintf(stderr, "rufs: could not allocate %d cache blocks\n", rufs_conf.cache_blocks);
+
+	if ( rufs_conf.io_uring && ! rufs_conf.mmap && bio_uring_init(BIO_URING_DEPTH) != 0 ) fprintf(stderr, "rufs: io_uring unavailable, using synchronous I/O\n");
+
+	icache_init();
+
+	if ( dev_open(diskfile_path) == -1 && rufs_format(diskfile_path, rufs_conf.size_mb, rufs_conf.inodes, NULL) != 0 ) {
+		fprintf(stderr, "rufs: could not create %s\n", diskfile_path);
+		exit(EXIT_FAILURE);
+	}
+
+	superblock_ptr = bio_get(SUPERBLOCK_BLKNO);
+	if ( superblock_ptr == NULL || superblock_ptr->magic_num != MAGIC_NUM ) {
+		fprintf(stderr, "rufs: %s is not a rufs disk of this version\n", diskfile_path);
+		exit(EXIT_FAILURE);
+	}
+
+	// The table on the disk is only trusted after a clean unmount with checksums on, so the flag is cleared while mounted
+	if ( rufs_conf.csum && rufs_conf.mmap ) fprintf(stderr, "rufs: checksums need the block cache, not used with mmap\n");
+	else if ( rufs_conf.csum && bio_csum_init(superblock_ptr->c_start_blk, superblock_ptr->nblocks, ! (superblock_ptr->flags & SB_CSUM_VALID), rufs_conf.csum) != 0 ) {
+		fprintf(stderr, "rufs: could not read the checksums of %s\n", diskfile_path);
+		exit(EXIT_FAILURE);
+	}
+
+	if ( superblock_ptr->flags & SB_CSUM_VALID ) {
+		superblock_ptr->flags &= ~SB_CSUM_VALID;
+		bio_dirty(superblock_ptr);
+		bio_flush();
+	}
+
+	if ( alloc_map_init(&inode_map, superblock_ptr->i_bitmap_blk, superblock_ptr->max_inum, &superblock_ptr->free_inodes) != 0 ||
+		alloc_map_init(&block_map, superblock_ptr->d_bitmap_blk, superblock_ptr->max_dnum, &superblock_ptr->free_blocks) != 0 ) {
+		fprintf(stderr, "rufs: could not read the bitmaps of %s\n", diskfile_path);
+		exit(EXIT_FAILURE);
+	}
+
+	dcache_init();
+
+	if ( rufs_conf.dedup && dedup_init(superblock_ptr->max_dnum) != 0 ) {
+		fprintf(stderr, "rufs: no memory for the dedup index, not deduplicating\n");
+		dedup_free();
+		rufs_conf.dedup = 0;
+	}
+
+	inode_locks = malloc(superblock_ptr->max_inum * sizeof(pthread_rwlock_t));
+	for ( int i = 0; i < superblock_ptr->max_inum; i++ ) pthread_rwlock_init(&inode_locks[i], NULL);
+
+	return NULL;
+}
+
+static void rufs_destroy(void *userdata) {
+
+	isync();
+
+	for ( int i = 0; i < superblock_ptr->max_inum; i++ ) pthread_rwlock_destroy(&inode_locks[i]);
+	free(inode_locks);
+
+	alloc_map_free(&inode_map);
+	alloc_map_free(&block_map);
+	dedup_free();
+
+	// Everything else, checksums included, is on the disk before the superblock says the table is good
+	bio_flush();
+	if ( rufs_conf.csum && ! rufs_conf.mmap ) {
+		superblock_ptr->flags |= SB_CSUM_VALID;
+		bio_dirty(superblock_ptr);
+	}
+	bio_put(superblock_ptr);
+
+	bio_flush();
+
+	struct bio_cache_stats stats;
+	bio_cache_stats(&stats);
+
+	dev_close();
+
+	if ( ! rufs_conf.mmap ) fprintf(stderr, "rufs: block cache hits %lu misses %lu evictions %lu writebacks %lu readaheads %lu checksum errors %lu\n", stats.hits, stats.misses, stats.evictions, stats.writebacks, stats.readaheads, stats.csum_errors);
+
+}
+
+// Answered from the superblock's free counts, without looking at the bitmaps
+static int rufs_statfs(const char *path, struct statvfs *stbuf) {
+
+	memset(stbuf, 0, sizeof(struct statvfs));
+
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = superblock_ptr->max_dnum;
+	// Blocks reserved for buffered data are as good as used
+	pthread_mutex_lock(&alloc_lock);
+	int resv = block_resv;
+	pthread_mutex_unlock(&alloc_lock);
+
+	stbuf->f_bfree = __atomic_load_n(&superblock_ptr->free_blocks, __ATOMIC_RELAXED) - resv;
+	stbuf->f_bavail = stbuf->f_bfree;
+	stbuf->f_files = superblock_ptr->max_inum;
+	stbuf->f_ffree = __atomic_load_n(&superblock_ptr->free_inodes, __ATOMIC_RELAXED);
+	stbuf->f_favail = stbuf->f_ffree;
+	stbuf->f_namemax = DIRENT_NAME_MAX;
+
+	return 0;
+}
+
+// The only place a struct stat is made, the inode keeps just what it needs to build one
+static void inode_stat(const struct inode *inode, struct stat *stbuf) {
+
+	memset(stbuf, 0, sizeof(*stbuf));
+
+	stbuf->st_ino = inode->ino;
+	stbuf->st_mode = inode->mode;
+	stbuf->st_nlink = inode->link;
+	stbuf->st_uid = inode->uid;
+	stbuf->st_gid = inode->gid;
+	stbuf->st_size = inode->bytes;
+	stbuf->st_blksize = BLOCK_SIZE;
+	stbuf->st_blocks = (blkcnt_t) (inode->size - inode->holes) * (BLOCK_SIZE / 512);
+	stbuf->st_atime = inode->atime;
+	stbuf->st_mtime = inode->mtime;
+	stbuf->st_ctime = inode->ctime;
+}
+
+static int rufs_getattr(const char *path, struct stat *stbuf) {
+
+	struct inode temp;
+	int retval = get_node_by_path(path, ROOT_DIRECTORY_INO, &temp);
+	if ( retval == 0 ) {
+		inode_stat(&temp, stbuf);
+		return 0;
+	} else return retval;
+	
+}
+
+static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
+
+	struct inode ino;
+	int retval = get_node_by_path(path, ROOT_DIRECTORY_INO, &ino);
+	if ( retval != 0 ) return retval;
+	else return 0;
+
+}
+
+static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+
+	struct inode inode;
+	int retval = get_node_by_path(path, ROOT_DIRECTORY_INO, &inode);
+	if ( retval != 0 ) return retval;
+	if ( inode.type != IS_DIRECTORY ) return -ENOTDIR;
+
+	ilock(inode.ino, 0);
+	retval = readi(inode.ino, &inode);
+	if ( retval != 0 ) {
+		iunlock(inode.ino);
+		return retval;
+	}
+
+	for ( int i = DIR_INDEX_BLOCK + 1; i < inode.size; i++ ) {
+
+		char *block = bio_get(dir_block(&inode, i));
+		if ( block == NULL ) {
+			iunlock(inode.ino);
+			return -EIO;
+		}
+
+		for ( int off = 0; off < BLOCK_SIZE; off = dirent_next(block, off) ) {
+
+			struct dirent *d = (struct dirent *) (block + off);
+			if ( d->name_len == 0 ) continue;
+
+			char name[DIRENT_NAME_MAX + 1];
+			memcpy(name, d->name, d->name_len);
+			name[d->name_len] = '\0';
+
+			struct stat st = { .st_ino = d->ino, .st_mode = d->type == IS_DIRECTORY ? __S_IFDIR : __S_IFREG };
+			filler(buffer, name, &st, 0);
+
+		}
+
+		bio_put(block);
+
+	}
+
+	itouch(inode.ino);
+	iunlock(inode.ino);
+
+	return 0;
+}
+
+
+static int rufs_mkdir(const char *path, mode_t mode) {
+
+	char path_cpy1[strlen(path) + 1], path_cpy2[strlen(path) + 1];
+	strcpy(path_cpy1, path);
+	strcpy(path_cpy2, path);
+
+	char *directory_path = dirname(path_cpy1);
+	char *directory_name = basename(path_cpy2);
+
+	struct inode parent_inode;
+	int retval = get_node_by_path(directory_path, ROOT_DIRECTORY_INO, &parent_inode);
+	if ( retval != 0 ) return retval;
+	if ( parent_inode.type != IS_DIRECTORY ) return -ENOTDIR;
+
+	int inode = get_avail_ino();
+	if ( inode == -1 ) return -ENOMEM;
+	
+	struct inode base_inode;
+	memset(&base_inode, 0, sizeof(base_inode));
+
+	base_inode.ino = inode;
+	base_inode.type = IS_DIRECTORY;
+	base_inode.valid = VALID;
+	base_inode.link = 2;
+
+	retval = dir_init_blocks(&base_inode, parent_inode.ino);
+	if ( retval != 0 ) {
+		release_ino(inode);
+		return retval;
+	}
+
+	base_inode.atime = time(NULL);
+	base_inode.ctime = time(NULL);
+	base_inode.mtime = time(NULL);
+	base_inode.uid = getuid();
+	base_inode.gid = getgid();
+	base_inode.mode = __S_IFDIR | mode;
+	base_inode.bytes = DIRENT_REC_LEN(1) + DIRENT_REC_LEN(2);
+
+	retval = writei(inode, &base_inode);
+
+	// Only now that the inode is complete does it become visible in the parent
+	if ( retval == 0 ) {
+		ilock(parent_inode.ino, 1);
+		retval = readi(parent_inode.ino, &parent_inode);
+		if ( retval == 0 ) retval = dir_add(parent_inode, inode, IS_DIRECTORY, directory_name, strlen(directory_name));
+		iunlock(parent_inode.ino);
+	}
+
+	if ( retval != 0 ) {
+		for ( int i = 0; i < base_inode.size; i++ ) release_blkno(base_inode.direct_ptr[i]);
+		ifree(inode);
+		return retval;
+	}
+
+	return 0;
+}
+
+static int rufs_rmdir(const char *path) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+	return 0;
+}
+
+static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
+	// For this project, you don't need to fill this function
+	// But DO NOT DELETE IT!
+    return 0;
+}
+
+/*
+ * An open file, kept in fi->fh. Small writes collect in wb_buf while they
+ * follow on from each other and reach the file a block-aligned chunk at a
+ * time, so an appender does not merge into its tail block on every call.
+ * Buffered data has no blocks yet: they are allocated as one extent when
+ * it is flushed, and the buffer doubles up to WB_MAX_SIZE while a writer
+ * keeps filling it, so concurrent appenders do not interleave on disk.
+ * The blocks it may need are reserved as it is buffered, however big the
+ * buffer has grown; data that cannot get a reservation is written
+ * through, so running out of space shows up at write time rather than at
+ * release. Once emptied, a grown buffer is freed. At most one handle of an inode
+ * holds buffered data, named by its inode cache entry, and anything else
+ * touching the data flushes it first. Buffered writes already count
+ * towards st_size.
+ *
+ * A read that starts where the handle's last one ended doubles its
+ * readahead window, up to RA_MAX_BLOCKS, and any other read closes it.
+ * The ra_ fields are guarded by ra_lock; readers that find it taken just
+ * skip readahead.
+ */
+struct file_handle {
+	struct inode	*inode;			/* pinned in the inode cache until release */
+	off_t			wb_off;			/* file offset of wb_buf[0] */
+	size_t			wb_len;
+	size_t			wb_size;
+	unsigned char	*wb_buf;		/* wb_size bytes, WB_SIZE on first use */
+	int				wb_resv;		/* blocks reserved for the buffered data */
+	uint64_t		wb_bytes;		/* st_size before the buffered data */
+	pthread_mutex_t	ra_lock;
+	off_t			ra_next;		/* offset a sequential read starts at */
+	int				ra_window;		/* blocks to keep prefetched, 0 if not sequential */
+	int				ra_end;			/* first logical block not prefetched */
+};
+
+static int fh_open(struct fuse_file_info *fi, uint32_t ino) {
+
+	struct file_handle *fh = calloc(1, sizeof(struct file_handle));
+	if ( fh == NULL ) return -ENOMEM;
+
+	fh->inode = iget(ino);
+	if ( fh->inode == NULL ) {
+		free(fh);
+		return -EIO;
+	}
+
+	pthread_mutex_init(&fh->ra_lock, NULL);
+
+	fi->fh = (uintptr_t) fh;
+
+	return 0;
+}
+
+static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+
+	char path_cpy1[strlen(path) + 1], path_cpy2[strlen(path) + 1];
+	strcpy(path_cpy1, path);
+	strcpy(path_cpy2, path);
+
+	char *directory_path = dirname(path_cpy1);
+	char *file_name = basename(path_cpy2);
+
+	struct inode par_inode; 
+	int retval = get_node_by_path(directory_path, ROOT_DIRECTORY_INO, &par_inode);
+	if ( retval != 0 ) return retval;
+	if ( par_inode.type != IS_DIRECTORY ) return -ENOTDIR;
+
+	int ino_num = get_avail_ino();
+	if ( ino_num == -1 ) return -ENOMEM;
+
+	struct inode file_inode;
+	memset(&file_inode, 0, sizeof(file_inode));
+
+	file_inode.ino = ino_num;
+	file_inode.type = IS_FILE;
+	file_inode.valid = VALID;
+	file_inode.link = 1;
+	file_inode.flags = INODE_INLINE | (rufs_conf.compress ? INODE_COMPRESS : 0);
+	file_inode.size = 0;
+
+	file_inode.atime = time(NULL);
+	file_inode.ctime = time(NULL);
+	file_inode.mtime = time(NULL);
+	file_inode.uid = getuid();
+	file_inode.gid = getgid();
+	file_inode.mode = __S_IFREG | mode;
+	file_inode.bytes = 0;
+	
+	retval = writei(ino_num, &file_inode);
+
+	// Only now that the inode is complete does it become visible in the parent
+	if ( retval == 0 ) {
+		ilock(par_inode.ino, 1);
+		retval = readi(par_inode.ino, &par_inode);
+		if ( retval == 0 ) retval = dir_add(par_inode, ino_num, IS_FILE, file_name, strlen(file_name));
+		iunlock(par_inode.ino);
+	}
+
+	if ( retval != 0 ) {
+		ifree(ino_num);
+		return retval;
+	}
+
+	return fh_open(fi, ino_num);
+}
+
+static int rufs_open(const char *path, struct fuse_file_info *fi) {
+
+	struct inode open_inode;
+	int retval = get_node_by_path(path, ROOT_DIRECTORY_INO, &open_inode);
+	if ( retval != 0 ) return retval;
+
+	return fh_open(fi, open_inode.ino);
+
+}
+
+/*
+ * Queues one request per run of physically contiguous blocks in
+ * blknos[0..count), bufs[i] holding the data for blknos[i], and submits
+ * them together.
+ */
+static int bio_runs(const int *blknos, void **bufs, int count, int write) {
+
+	struct bio_batch batch;
+	bio_batch_init(&batch);
+
+	int start = 0;
+
+	for ( int i = 1; i <= count; i++ ) {
+
+		if ( i < count && blknos[i] == blknos[i - 1] + 1 ) continue;
+
+		if ( bio_batch_add(&batch, blknos[start], bufs + start, i - start, write) < 0 ) return -EIO;
+
+		start = i;
+
+	}
+
+	if ( bio_batch_submit(&batch) < 0 ) return -EIO;
+
+	return 0;
+}
+
+/*
+ * Compressed files. Data is read and written a cluster at a time: a write
+ * that covers only part of one reads and expands it first, then the whole
+ * cluster is compressed again and stored in whatever it now needs, raw if
+ * compression would not save a block.
+ */
+
+// The slots of cluster c that are mapped, 0 when the file ends before it
+static int cluster_slots(struct inode *inode, int c) {
+
+	int slots = (int) inode->size - c * CLUSTER_BLOCKS;
+
+	return (slots < 0) ? 0 : (slots > CLUSTER_BLOCKS) ? CLUSTER_BLOCKS : slots;
+}
+
+// Reads cluster c into buf, CLUSTER_SIZE bytes with zeros wherever nothing is stored; scratch is as big
+static int cluster_read(struct inode *inode, int c, unsigned char *buf, unsigned char *scratch) {
+
+	int slots = cluster_slots(inode, c);
+	int blknos[CLUSTER_BLOCKS], phys[CLUSTER_BLOCKS], n = 0;
+	void *bufs[CLUSTER_BLOCKS];
+
+	memset(buf, 0, CLUSTER_SIZE);
+	if ( slots == 0 ) return 0;
+
+	int retval = bmap(inode, c * CLUSTER_BLOCKS, slots, blknos);
+	if ( retval != 0 ) return retval;
+
+	int compressed = blknos[0] == CLUSTER_COMPRESSED;
+
+	for ( int i = compressed; i < slots; i++ ) {
+		if ( blknos[i] <= 0 ) continue;
+		phys[n] = blknos[i];
+		bufs[n] = compressed ? scratch + (size_t) n * BLOCK_SIZE : buf + (size_t) i * BLOCK_SIZE;
+		n++;
+	}
+
+	retval = bio_runs(phys, bufs, n, 0);
+	if ( retval != 0 || ! compressed ) return retval;
+
+	uint32_t clen;
+	memcpy(&clen, scratch, sizeof(clen));
+
+	if ( clen > (size_t) n * BLOCK_SIZE - sizeof(clen) ) return -EIO;
+	if ( lz_decompress(scratch + sizeof(clen), clen, buf, CLUSTER_SIZE) < 0 ) return -EIO;
+
+	return 0;
+}
+
+/*
+ * Stores the first len bytes of buf as cluster c, the rest of buf being
+ * zeros, reusing the blocks the cluster already has before allocating
+ * next to them. The mapping is extended before anything is allocated, so
+ * running out of space leaves the data as it was.
+ */
+static int cluster_write(struct inode *inode, int c, unsigned char *buf, size_t len, unsigned char *scratch) {
+
+	int first = c * CLUSTER_BLOCKS;
+	int nblocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int mapped = cluster_slots(inode, c);
+	int old[CLUSTER_BLOCKS], new[CLUSTER_BLOCKS], phys[CLUSTER_BLOCKS];
+	int retval;
+
+	if ( mapped > 0 && (retval = bmap(inode, first, mapped, old)) != 0 ) return retval;
+
+	// Compressed data has to fit a block less than the raw data to be worth a slot for the marker
+	uint32_t clen = 0;
+	if ( nblocks > 1 ) clen = lz_compress(buf, len, scratch + sizeof(clen), (nblocks - 1) * BLOCK_SIZE - sizeof(clen));
+
+	int k = nblocks, used = nblocks;
+	unsigned char *data = buf;
+
+	if ( clen > 0 ) {
+		memcpy(scratch, &clen, sizeof(clen));
+		k = (clen + sizeof(clen) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		memset(scratch + sizeof(clen) + clen, 0, (size_t) k * BLOCK_SIZE - sizeof(clen) - clen);
+		used = k + 1;
+		data = scratch;
+	}
+
+	while ( inode->size < (uint32_t) (first + (used > mapped ? used : mapped)) ) {
+		retval = bmap_append(inode, 0);
+		if ( retval != 0 ) return retval;
+		inode->holes++;
+	}
+
+	int goal = -1, npool = 0, pool[CLUSTER_BLOCKS], prev[CLUSTER_BLOCKS];
+
+	for ( int i = 0; i < mapped; i++ ) {
+		if ( old[i] > 0 ) pool[npool++] = old[i];
+	}
+
+	// With nothing to reuse, carry on after the last block of the cluster before
+	if ( npool == 0 && c > 0 && bmap(inode, first - CLUSTER_BLOCKS, CLUSTER_BLOCKS, prev) == 0 ) {
+		for ( int i = 0; i < CLUSTER_BLOCKS; i++ ) {
+			if ( prev[i] > 0 ) goal = prev[i] + 1;
+		}
+	}
+
+	for ( int i = 0; i < k; i++ ) {
+
+		if ( i < npool ) phys[i] = pool[i];
+		else if ( (phys[i] = get_blkno_near(goal)) == -1 ) {
+			for ( int j = npool; j < i; j++ ) release_blkno(phys[j]);
+			return -ENOSPC;
+		}
+
+		goal = phys[i] + 1;
+
+	}
+
+	void *bufs[CLUSTER_BLOCKS];
+	for ( int i = 0; i < k; i++ ) bufs[i] = data + (size_t) i * BLOCK_SIZE;
+
+	retval = bio_runs(phys, bufs, k, 1);
+	if ( retval != 0 ) {
+		for ( int j = npool; j < k; j++ ) release_blkno(phys[j]);
+		return retval;
+	}
+
+	int slots = (used > mapped) ? used : mapped;
+
+	for ( int i = 0; i < slots; i++ ) {
+
+		if ( clen > 0 ) new[i] = (i == 0) ? CLUSTER_COMPRESSED : (i <= k) ? phys[i - 1] : 0;
+		else new[i] = (i < k) ? phys[i] : 0;
+
+		int was = (i < mapped) ? old[i] : 0;
+		if ( new[i] == was ) continue;
+
+		retval = bmap_set(inode, first + i, new[i]);
+		if ( retval != 0 ) return retval;
+
+		inode->holes += (new[i] <= 0) - (was <= 0);
+
+	}
+
+	for ( int i = k; i < npool; i++ ) release_blkno(pool[i]);
+
+	return 0;
+}
+
+static int compressed_read(struct inode *inode, char *buffer, size_t size, off_t offset) {
 
-char diskfile_path[PATH_MAX];
+	unsigned char *buf = malloc(2 * CLUSTER_SIZE);
+	if ( buf == NULL ) return -ENOMEM;
 
-unsigned char block_buf[BLOCK_SIZE], i_bitmap_buf[BLOCK_SIZE], d_bitmap_buf[BLOCK_SIZE], superblock_buf[BLOCK_SIZE];
+	for ( size_t done = 0; done < size; ) {
 
-struct superblock *superblock_ptr = (struct superblock *) superblock_buf;
+		off_t pos = offset + done;
+		size_t off = pos % CLUSTER_SIZE;
+		size_t n = (size - done < CLUSTER_SIZE - off) ? size - done : CLUSTER_SIZE - off;
 
-char cur_dir[] = ".", par_dir[] = "..";
+		int retval = cluster_read(inode, pos / CLUSTER_SIZE, buf, buf + CLUSTER_SIZE);
+		if ( retval != 0 ) {
+			free(buf);
+			return retval;
+		}
 
-int get_avail_ino() {
+		memcpy(buffer + done, buf + off, n);
+		done += n;
 
-	int ino = 0, found_flag = 0;
+	}
 
-	for ( int i = 0; i < (MAX_INUM / 8); i++ ) {
+	free(buf);
 
-		if ( i_bitmap_buf[i] == 255 ) ino += 8;
+	return size;
+}
 
-		else {
+static int compressed_write(struct inode *inode, const char *buffer, size_t size, off_t offset) {
 
-			unsigned char map = 1;
+	unsigned char *buf = malloc(2 * CLUSTER_SIZE);
+	if ( buf == NULL ) return -ENOMEM;
 
-			for ( int j = 0; j < 8; j++ ) {
+	off_t end = (offset + size > inode->bytes) ? offset + size : inode->bytes;
 
-				if ( i_bitmap_buf[i] & map ) {
-					map <<= 1;
-					ino++;
-				} else {
-					found_flag = 1;
-					break;
-				}
+	for ( size_t done = 0; done < size; ) {
 
-			}
+		off_t pos = offset + done;
+		int c = pos / CLUSTER_SIZE;
+		size_t off = pos % CLUSTER_SIZE;
+		size_t n = (size - done < CLUSTER_SIZE - off) ? size - done : CLUSTER_SIZE - off;
+		int retval = 0;
 
-			if ( found_flag ) break;
+		if ( n < CLUSTER_SIZE ) retval = cluster_read(inode, c, buf, buf + CLUSTER_SIZE);
 
+		if ( retval == 0 ) {
+			memcpy(buf + off, buffer + done, n);
+			size_t len = (end - (off_t) c * CLUSTER_SIZE < CLUSTER_SIZE) ? end - (off_t) c * CLUSTER_SIZE : CLUSTER_SIZE;
+			retval = cluster_write(inode, c, buf, len, buf + CLUSTER_SIZE);
 		}
 
-	}
+		if ( retval != 0 ) {
+			free(buf);
+			idirty(inode);
+			return retval;
+		}
 
-	if ( ! found_flag ) return -1;
+		done += n;
 
-	set_bitmap(i_bitmap_buf, ino);
+	}
 
-	bio_write(superblock_ptr->i_bitmap_blk, i_bitmap_buf);
+	free(buf);
 
-	return ino;
+	inode->atime = time(NULL);
+	inode->mtime = time(NULL);
+	if ( offset + size > inode->bytes ) inode->bytes = offset + size;
 
+	idirty(inode);
+
+	return size;
 }
 
-int get_avail_blkno() {
+// Reads from a file whose lock is held by the caller
+static int file_read(struct inode *inode, char *buffer, size_t size, off_t offset) {
 
-	int blkno = 0, found_flag = 0;
+	int retval;
 
-	for ( int i = 0; i < (MAX_DNUM / 8); i++ ) {
+	if ( offset >= inode->bytes ) return 0;
+	if ( offset + size > inode->bytes ) size = inode->bytes - offset;
 
-		if ( d_bitmap_buf[i] == 255 ) blkno += 8;
+	if ( inode->flags & INODE_INLINE ) {
+		memcpy(buffer, inode->inline_data + offset, size);
+		__atomic_store_n(&inode->atime, time(NULL), __ATOMIC_RELAXED);
+		idirty(inode);
+		return size;
+	}
 
-		else {
+	if ( inode->flags & INODE_COMPRESS ) {
+		retval = compressed_read(inode, buffer, size, offset);
+		if ( retval > 0 ) {
+			__atomic_store_n(&inode->atime, time(NULL), __ATOMIC_RELAXED);
+			idirty(inode);
+		}
+		return retval;
+	}
 
-			unsigned char map = 1;
+	int first_block = offset / BLOCK_SIZE;
+	int last_block = (offset + size - 1) / BLOCK_SIZE;
+	int nblocks = last_block - first_block + 1;
+	if ( last_block >= inode->size ) return -EIO;
 
-			for ( int j = 0; j < 8; j++ ) {
+	int blknos[nblocks];
+	retval = bmap(inode, first_block, nblocks, blknos);
+	if ( retval != 0 ) return retval;
 
-				if ( d_bitmap_buf[i] & map ) {
-					map <<= 1;
-					blkno++;
-				} else {
-					found_flag = 1;
-					break;
-				}
+	size_t head_off = offset % BLOCK_SIZE, tail_len = (offset + size) % BLOCK_SIZE;
+	unsigned char head_buf[BLOCK_SIZE], tail_buf[BLOCK_SIZE];
+	void *bufs[nblocks];
 
-			}
+	// Whole blocks are read straight into the caller's buffer, partial ones through bounce buffers
+	for ( int i = 0; i < nblocks; i++ ) bufs[i] = buffer + (size_t) i * BLOCK_SIZE - head_off;
+	if ( head_off != 0 || (nblocks == 1 && tail_len != 0) ) bufs[0] = head_buf;
+	if ( nblocks > 1 && tail_len != 0 ) bufs[nblocks - 1] = tail_buf;
 
-			if ( found_flag ) break;
+	// Reserved blocks not written yet are zeros without asking the disk
+	int rblknos[nblocks], n = 0;
+	void *rbufs[nblocks];
 
+	for ( int i = 0; i < nblocks; i++ ) {
+		if ( blknos[i] < 0 ) memset(bufs[i], 0, BLOCK_SIZE);
+		else {
+			rblknos[n] = blknos[i];
+			rbufs[n++] = bufs[i];
 		}
-
 	}
 
-	if ( ! found_flag ) return -1;
+	retval = bio_runs(rblknos, rbufs, n, 0);
+	if ( retval != 0 ) return retval;
+
+	if ( bufs[0] == head_buf ) memcpy(buffer, head_buf + head_off, (size < BLOCK_SIZE - head_off) ? size : BLOCK_SIZE - head_off);
+	if ( nblocks > 1 && bufs[nblocks - 1] == tail_buf ) memcpy(buffer + size - tail_len, tail_buf, tail_len);
 
-	set_bitmap(d_bitmap_buf, blkno);
+	__atomic_store_n(&inode->atime, time(NULL), __ATOMIC_RELAXED);
+	idirty(inode);
 
-	bio_write(superblock_ptr->d_bitmap_blk, d_bitmap_buf);
+	return size;
 
-	return blkno + superblock_ptr->d_start_blk;
 }
 
-int readi(uint16_t ino, struct inode *inode) {
-
-	int blkno = (ino / INODE_PER_BLOCK) + superblock_ptr->i_start_blk; 
-	int offset = ino % INODE_PER_BLOCK;
+// Moves an inline file's data out to a block of its own, before it grows past INLINE_DATA_MAX
+static int inline_spill(struct inode *inode) {
 
-	bio_read(blkno, block_buf);
+	unsigned char block[BLOCK_SIZE];
+	int blkno = -1;
 
-	struct inode *inode_ptr = (struct inode *) block_buf;
-	inode_ptr += offset;
+	// bytes may already cover write-behind data that is on its way in
+	size_t len = inode->bytes < INLINE_DATA_MAX ? inode->bytes : INLINE_DATA_MAX;
 
-	*(inode) = *(inode_ptr);
+	if ( len > 0 ) {
 
-	return 0;
-}
+		memset(block, 0, BLOCK_SIZE);
+		memcpy(block, inode->inline_data, len);
 
-int writei(uint16_t ino, struct inode *inode) {
+		blkno = get_avail_blkno();
+		if ( blkno == -1 ) return -ENOSPC;
 
-	int blkno = (ino / INODE_PER_BLOCK) + superblock_ptr->i_start_blk; 
-	int offset = ino % INODE_PER_BLOCK;
+		if ( bio_write(blkno, block) < 0 ) {
+			release_blkno(blkno);
+			return -EIO;
+		}
 
-	bio_read(blkno, block_buf);
+	}
 
-	struct inode *inode_ptr = (struct inode *) block_buf;
-	inode_ptr += offset;
+	memset(inode->inline_data, 0, INLINE_DATA_MAX);
+	inode->flags &= ~INODE_INLINE;
 
-	*(inode_ptr) = *(inode);
+	if ( blkno != -1 ) {
+		inode->direct_ptr[0] = blkno;
+		inode->size = 1;
+	}
 
-	bio_write(blkno, block_buf);
+	idirty(inode);
 
 	return 0;
 }
 
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-
-	struct inode dir_ino;
-	readi(ino, &dir_ino);
-
-	if ( dir_ino.type != IS_DIRECTORY ) return -ENOTDIR;
+/*
+ * Picks where each of the count blocks of a write from lblk is stored. A
+ * reserved block becomes a written one, a shared block is swapped for a
+ * copy of the file's own, and with dedup a block whose contents are
+ * stored already maps that copy and is not written at all. blknos follows
+ * the mapping; the blocks still to be written, with the CRC32C of each
+ * under dedup, are moved to the front of blknos, bufs and crcs and counted
+ * in *placed, which the caller writes out even if an error stopped the
+ * rest.
+ */
+static int file_place(struct inode *inode, int lblk, int *blknos, void **bufs, uint32_t *crcs, int count, int *placed) {
 
-	for ( int i = 0; i < dir_ino.size; i++ ) {
+	unsigned char stored[BLOCK_SIZE];
+	int n = 0, goal = -1, retval = 0;
 
-		bio_read(dir_ino.direct_ptr[i], block_buf);
+	for ( int i = 0; i < count && retval == 0; i++ ) {
 
-		struct dirent *dirent_ptr = (struct dirent *) block_buf;
+		int blkno = abs(blknos[i]);
+		uint32_t crc = rufs_conf.dedup ? crc32c(0, bufs[i], BLOCK_SIZE) : 0;
 
-		for ( int j = 0; j < DIRENT_PER_BLOCK; j++ ) {
+		int dup = rufs_conf.dedup ? dedup_claim(crc, blkno) : -1;
+		if ( dup != -1 ) {
+			// The CRC only finds a candidate, the contents decide
+			void *buf = stored;
+			if ( bio_readv(dup, &buf, 1) == 1 && memcmp(stored, bufs[i], BLOCK_SIZE) == 0 && (retval = bmap_set(inode, lblk + i, dup)) == 0 ) {
+				release_blkno(blkno);
+				continue;
+			}
+			release_blkno(dup);
+			if ( retval != 0 ) break;
+		}
 
-			if ( (dirent_ptr[j].valid) && (dirent_ptr[j].len == name_len) && (memcmp(fname, dirent_ptr[j].name, name_len) == 0) ) {
-				*(dirent) = dirent_ptr[j];
-				return 0;
+		if ( block_shared(blkno) ) {
+			int copy = get_blkno_near((goal != -1) ? goal : blkno + 1);
+			if ( copy == -1 ) {
+				retval = -ENOSPC;
+				break;
+			}
+			retval = bmap_set(inode, lblk + i, copy);
+			if ( retval != 0 ) {
+				release_blkno(copy);
+				break;
 			}
+			release_blkno(blkno);
+			blkno = copy;
+		} else if ( blknos[i] < 0 && (retval = bmap_set(inode, lblk + i, blkno)) != 0 ) break;
 
-		}
+		blknos[n] = blkno;
+		bufs[n] = bufs[i];
+		crcs[n] = crc;
+		n++;
+		goal = blkno + 1;
 
 	}
 
-	return -ENOENT;
+	*(placed) = n;
 
+	return retval;
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+/*
+ * Maps logical blocks up to last on the end of a plain file, each run
+ * taken from the bitmap in one go right after the file's last block, so a
+ * range that reaches the file in one piece lies on disk in one piece too.
+ * Blocks in front of first_written are only reserved.
+ */
+static int file_extend(struct inode *inode, int last, int first_written) {
 
-	char invalid_flag = 0;
+	int retval = 0, goal = -1;
 
-	for ( int i = 0; i < dir_inode.size; i++ ) {
+	if ( inode->size > 0 ) {
+		retval = bmap(inode, inode->size - 1, 1, &goal);
+		if ( retval != 0 ) return retval;
+		goal = abs(goal) + 1;
+	}
 
-		bio_read(dir_inode.direct_ptr[i], block_buf);
+	while ( inode->size <= last ) {
 
-		struct dirent *dirent_ptr = (struct dirent *) block_buf;
+		int got, i = 0;
+		int blkno = get_blkno_run(goal, last + 1 - inode->size, &got);
+		if ( blkno == -1 ) return -ENOSPC;
 
-		for ( int j = 0; j < DIRENT_PER_BLOCK; j++ ) {
-			
-			if ( ! dirent_ptr[j].valid ) {
-				invalid_flag = 1;
-			} else if ( (dirent_ptr[j].len == name_len) && (memcmp(fname, dirent_ptr[j].name, name_len) == 0) ) return -EEXIST;
+		for ( ; i < got; i++ ) {
+			retval = bmap_append(inode, (inode->size < first_written) ? -(blkno + i) : blkno + i);
+			if ( retval != 0 ) break;
+		}
 
+		if ( retval != 0 ) {
+			for ( ; i < got; i++ ) release_blkno(blkno + i);
+			return retval;
 		}
 
+		goal = blkno + got;
+
 	}
 
-	if ( invalid_flag ) {
+	return 0;
+}
+
+// Writes to a file whose lock is held for writing by the caller, updating the cached *inode
+static int file_write(struct inode *inode, const char *buffer, size_t size, off_t offset) {
 
-		for ( int i = 0; i < dir_inode.size; i++ ) {
+	static const unsigned char zero_block[BLOCK_SIZE];
 
-			bio_read(dir_inode.direct_ptr[i], block_buf);
+	int retval;
 
-			struct dirent *dirent_ptr = (struct dirent *) block_buf;
+	if ( size == 0 ) return 0;
 
-			for ( int j = 0; j < DIRENT_PER_BLOCK; j++ ) {
+	if ( inode->flags & INODE_INLINE ) {
+
+		if ( offset + size <= INLINE_DATA_MAX ) {
+			memcpy(inode->inline_data + offset, buffer, size);
+			inode->atime = time(NULL);
+			inode->mtime = time(NULL);
+			if ( offset + size > inode->bytes ) inode->bytes = offset + size;
+			idirty(inode);
+			return size;
+		}
 
-				if ( ! dirent_ptr[j].valid ) {
+		retval = inline_spill(inode);
+		if ( retval != 0 ) return retval;
 
-					dirent_ptr[j].valid = VALID;
-					dirent_ptr[j].ino = f_ino;
-					dirent_ptr[j].len = name_len;
-					memcpy(dirent_ptr[j].name, fname, name_len);
-					bio_write(dir_inode.direct_ptr[i], block_buf);
+	}
 
-					dir_inode.vstat.st_size += sizeof(struct dirent);
-					dir_inode.vstat.st_atime = time(NULL);
-					dir_inode.vstat.st_mtime = time(NULL);
-					writei(dir_inode.ino, &dir_inode);
+	int first_block = offset / BLOCK_SIZE;
+	int last_block = (offset + size - 1) / BLOCK_SIZE;
+	int nblocks = last_block - first_block + 1;
+	if ( last_block >= MAX_FILE_BLOCKS ) return -EFBIG;
 
-					return 0;
+	if ( inode->flags & INODE_COMPRESS ) return compressed_write(inode, buffer, size, offset);
 
-				}
+	int old_blocks = inode->size;
 
-			}
+	// Any hole in front of the write reads as zeros without being written
+	retval = file_extend(inode, last_block, first_block);
 
+	// Blocks this write would have filled stay mapped past st_size, so clear them for a later write to merge into
+	if ( retval != 0 ) {
+		for ( int l = (first_block > old_blocks) ? first_block : old_blocks; l < inode->size; l++ ) {
+			int blkno;
+			if ( bmap(inode, l, 1, &blkno) == 0 ) bio_write(blkno, zero_block);
 		}
+		idirty(inode);
+		return retval;
+	}
 
-	} else {
+	int blknos[nblocks];
+	retval = bmap(inode, first_block, nblocks, blknos);
+	if ( retval != 0 ) return retval;
 
-		if ( dir_inode.size == 16 ) return -EFBIG;
+	size_t head_off = offset % BLOCK_SIZE, tail_len = (offset + size) % BLOCK_SIZE;
+	unsigned char head_buf[BLOCK_SIZE], tail_buf[BLOCK_SIZE];
+	void *bufs[nblocks];
 
-		int blkno = get_avail_blkno();
-		if ( blkno == -1 ) return -ENOMEM;
+	// Whole blocks are written straight from the caller's buffer, partial ones are merged into bounce buffers
+	for ( int i = 0; i < nblocks; i++ ) bufs[i] = (char *) buffer + (size_t) i * BLOCK_SIZE - head_off;
 
-		bio_read(blkno, block_buf);
+	int head_partial = head_off != 0 || (nblocks == 1 && tail_len != 0);
+	int tail_partial = nblocks > 1 && tail_len != 0;
 
-		struct dirent *dirent_ptr = (struct dirent *) block_buf;
+	struct bio_batch batch;
+	bio_batch_init(&batch);
 
-		for ( int i = 0; i < DIRENT_PER_BLOCK; i++ ) dirent_ptr[i].valid = INVALID;
+	if ( head_partial ) {
+		bufs[0] = head_buf;
+		if ( first_block < old_blocks && blknos[0] > 0 ) bio_batch_add(&batch, blknos[0], bufs, 1, 0);
+		else memset(head_buf, 0, BLOCK_SIZE);
+	}
 
-		dirent_ptr->valid = VALID;
-		dirent_ptr->ino = f_ino;
-		dirent_ptr->len = name_len;
-		memcpy(dirent_ptr->name, fname, name_len);
+	if ( tail_partial ) {
+		bufs[nblocks - 1] = tail_buf;
+		if ( last_block < old_blocks && blknos[nblocks - 1] > 0 ) bio_batch_add(&batch, blknos[nblocks - 1], &bufs[nblocks - 1], 1, 0);
+		else memset(tail_buf, 0, BLOCK_SIZE);
+	}
 
-		bio_write(blkno, block_buf);
+	if ( bio_batch_submit(&batch) < 0 ) return -EIO;
 
-		dir_inode.direct_ptr[dir_inode.size++] = blkno;
-		dir_inode.vstat.st_size += sizeof(struct dirent);
-		dir_inode.vstat.st_blksize++;
-		dir_inode.vstat.st_blocks++;
-		dir_inode.vstat.st_atime = time(NULL);
-		dir_inode.vstat.st_mtime = time(NULL);
+	if ( head_partial ) memcpy(head_buf + head_off, buffer, (size < BLOCK_SIZE - head_off) ? size : BLOCK_SIZE - head_off);
+	if ( tail_partial ) memcpy(tail_buf, buffer + size - tail_len, tail_len);
 
-		writei(dir_inode.ino, &dir_inode);
+	uint32_t crcs[nblocks];
+	int placed;
 
-		return 0;
+	retval = file_place(inode, first_block, blknos, bufs, crcs, nblocks, &placed);
 
+	int written = bio_runs(blknos, bufs, placed, 1);
+	if ( retval == 0 ) retval = written;
+	if ( retval != 0 ) {
+		idirty(inode);
+		return retval;
 	}
 
-	return -ENOMEM;
-}
+	// Indexed only once they hold what the index says
+	for ( int i = 0; rufs_conf.dedup && i < placed; i++ ) dedup_add(blknos[i], crcs[i]);
 
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+	inode->atime = time(NULL);
+	inode->mtime = time(NULL);
+	if ( offset + size > inode->bytes ) inode->bytes = offset + size;
+
+	idirty(inode);
+
+	return size;
 }
 
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+// Copies len bytes from src to dest a chunk at a time, for files whose blocks cannot be shared
+static int file_copy(struct inode *dest, struct inode *src, off_t src_off, size_t len, off_t dest_off) {
 
-	struct inode dir_inode;
-	readi(ino, &dir_inode);
+	char *buf = malloc(CLUSTER_SIZE);
+	if ( buf == NULL ) return -ENOMEM;
 
-	char *s1 = strchr(path, '/');
-	if ( s1 == NULL ) return -ENOENT;
-	s1++;
-	int s1_length = strlen(s1);
-	if ( s1_length == 0 ) {
-		*(inode) = dir_inode;
-		return 0;
+	int retval = 0;
+
+	for ( size_t done = 0; done < len && retval >= 0; done += CLUSTER_SIZE ) {
+		size_t n = (len - done < CLUSTER_SIZE) ? len - done : CLUSTER_SIZE;
+		retval = file_read(src, buf, n, src_off + done);
+		if ( retval == (int) n ) retval = file_write(dest, buf, n, dest_off + done);
+		else if ( retval >= 0 ) retval = -EIO;
 	}
 
+	free(buf);
 
-	char *s2 = strchr(s1, '/');
-	if ( s2 == NULL ) {
-		
-		struct dirent dirent;
-		int retval = dir_find(ino, s1, s1_length, &dirent);
-		if ( retval != 0 ) return retval;
+	return (retval < 0) ? retval : 0;
+}
 
-		readi(dirent.ino, inode);
+/*
+ * Makes dest map the blocks holding len bytes of src from src_off, from
+ * dest_off on, with both locked for writing and nothing buffered. The
+ * blocks dest mapped there are released and any gap in front of the range
+ * is filled with zeros. Only plain files share blocks; an inline or
+ * compressed file on either side is copied instead.
+ */
+static int file_clone(struct inode *dest, struct inode *src, off_t src_off, size_t len, off_t dest_off) {
 
-	} else {
+	static const char zero_block[BLOCK_SIZE];
 
-		int s2_length = strlen(s2);
+	int retval;
 
-		int subdir_length = s1_length - s2_length;
-		if ( subdir_length == 0 ) return -ENOENT;
+	if ( src_off < 0 || dest_off < 0 || src_off > src->bytes ) return -EINVAL;
+	if ( len == 0 || len > src->bytes - src_off ) len = src->bytes - src_off;
+	if ( len == 0 ) return 0;
 
-		char subdir_name[subdir_length];
-		memcpy(subdir_name, s1, subdir_length);
+	// A partial last block is only shared where nothing of dest follows it
+	if ( src_off % BLOCK_SIZE != 0 || dest_off % BLOCK_SIZE != 0 ) return -EINVAL;
+	if ( len % BLOCK_SIZE != 0 && (src_off + len != src->bytes || dest_off + len < dest->bytes) ) return -EINVAL;
 
-		struct dirent dirent;
-		int retval = dir_find(ino, subdir_name, subdir_length, &dirent);
-		if ( retval != 0 ) return retval;
+	int first = src_off / BLOCK_SIZE, dest_first = dest_off / BLOCK_SIZE;
+	int nblocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if ( dest_first + nblocks > MAX_FILE_BLOCKS ) return -EFBIG;
 
-		return get_node_by_path(s2, dirent.ino, inode);
+	if ( (src->flags & (INODE_INLINE | INODE_COMPRESS)) || (dest->flags & INODE_COMPRESS) ) return file_copy(dest, src, src_off, len, dest_off);
 
+	if ( dest->flags & INODE_INLINE ) {
+		retval = inline_spill(dest);
+		if ( retval != 0 ) return retval;
 	}
 
-	return 0;
-}
-
-int rufs_mkfs() {
+	for ( off_t off = dest->bytes; off < dest_off; off += retval ) {
+		size_t n = (dest_off - off < BLOCK_SIZE) ? dest_off - off : BLOCK_SIZE;
+		retval = file_write(dest, zero_block, n, off);
+		if ( retval < 0 ) return retval;
+	}
 
-	dev_init(diskfile_path);
+	int done = 0;
+	retval = 0;
 
-	memset(superblock_buf, 0, BLOCK_SIZE);
+	while ( done < nblocks && retval == 0 ) {
 
-	superblock_ptr->magic_num = MAGIC_NUM;
-	superblock_ptr->max_inum = MAX_INUM;
-	superblock_ptr->max_dnum = MAX_DNUM;
+		int n = (nblocks - done < PTRS_PER_BLOCK) ? nblocks - done : PTRS_PER_BLOCK;
+		int blknos[n];
 
-	int blocks_for_i_bitmap = ((MAX_INUM / 8) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	int blocks_for_d_bitmap = ((MAX_DNUM / 8) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	int blocks_for_inodes = (sizeof(struct inode) * MAX_INUM) / BLOCK_SIZE;
+		retval = bmap(src, first + done, n, blknos);
 
-	superblock_ptr->i_bitmap_blk = 1;
-	superblock_ptr->d_bitmap_blk = superblock_ptr->i_bitmap_blk + blocks_for_i_bitmap;
-	superblock_ptr->i_start_blk = superblock_ptr->d_bitmap_blk + blocks_for_d_bitmap;
-	superblock_ptr->d_start_blk = superblock_ptr->i_start_blk + blocks_for_inodes;
+		for ( int i = 0; i < n && retval == 0; i++ ) {
 
-	bio_write(SUPERBLOCK_BLKNO, superblock_buf);
+			int l = dest_first + done, old = 0;
 
-	memset(i_bitmap_buf, 0, BLOCK_SIZE);
-	memset(d_bitmap_buf, 0, BLOCK_SIZE);
+			// A reserved block is shared reserved, and reads as zeros in dest too
+			retval = block_share(abs(blknos[i]));
+			if ( retval != 0 ) break;
 
-	for ( int i = 0; i < blocks_for_inodes; i++ ) bio_write(i + superblock_ptr->i_start_blk, i_bitmap_buf);
+			if ( l < dest->size ) {
+				retval = bmap(dest, l, 1, &old);
+				if ( retval == 0 ) retval = bmap_set(dest, l, blknos[i]);
+			} else retval = bmap_append(dest, blknos[i]);
 
-	struct inode root_ino;
-	root_ino.ino = get_avail_ino();
-	if ( root_ino.ino == -1 ) return -ENOMEM;
+			if ( retval != 0 ) {
+				release_blkno(abs(blknos[i]));
+				break;
+			}
 
-	root_ino.type = IS_DIRECTORY;
-	root_ino.valid = VALID;
+			if ( old != 0 ) release_blkno(abs(old));
+			done++;
 
-	int dir_blkno = get_avail_blkno();
-	if ( dir_blkno == -1 ) return -ENOMEM;
+		}
 
-	bio_read(dir_blkno, block_buf);
-	struct dirent *dirent_ptr = (struct dirent *) block_buf;
+	}
 
-	dirent_ptr->ino = root_ino.ino;
-	dirent_ptr->valid = VALID;
-	memcpy(dirent_ptr->name, cur_dir, 1);
-	dirent_ptr->len = 1;
-	dirent_ptr++;
+	// Whatever was shared before an error stays, and dest's size takes it in
+	off_t end = (done == nblocks) ? dest_off + len : dest_off + (off_t) done * BLOCK_SIZE;
+	if ( end > dest->bytes ) dest->bytes = end;
 
-	dirent_ptr->ino = root_ino.ino;
-	dirent_ptr->valid = VALID;
-	memcpy(dirent_ptr->name, par_dir, 2);
-	dirent_ptr->len = 2;
+	dest->mtime = time(NULL);
+	dest->ctime = time(NULL);
+	idirty(dest);
 
-	bio_write(dir_blkno, block_buf);
+	return retval;
+}
 
-	root_ino.direct_ptr[0] = dir_blkno;
-	root_ino.size = 1;
+/*
+ * Reserves the blocks holding len bytes from offset, with the file locked
+ * for writing and nothing buffered, and grows the file to cover them
+ * unless mode has FALLOC_FL_KEEP_SIZE. Only blocks past the mapped end are
+ * new; they are mapped as reserved and read as zeros until written.
+ */
+static int file_fallocate(struct inode *inode, int mode, off_t offset, off_t len) {
 
-	root_ino.vstat.st_ctime = time(NULL);
-	root_ino.vstat.st_atime = time(NULL);
-	root_ino.vstat.st_mtime = time(NULL);
-	root_ino.vstat.st_uid = getuid();
-	root_ino.vstat.st_gid = getgid();
-	root_ino.vstat.st_blksize = root_ino.size;
-	root_ino.vstat.st_blocks = root_ino.size;
-	root_ino.vstat.st_ino = root_ino.ino;
-	root_ino.vstat.st_mode = __S_IFDIR | 0755;
-	root_ino.vstat.st_nlink = 2;
-	root_ino.vstat.st_size = sizeof(struct dirent) * 2;
+	int retval = 0;
 
-	writei(root_ino.ino, &root_ino);
+	if ( offset < 0 || len <= 0 ) return -EINVAL;
+	if ( (mode & ~FALLOC_FL_KEEP_SIZE) || (inode->flags & INODE_COMPRESS) ) return -EOPNOTSUPP;
+	if ( (offset + len - 1) / BLOCK_SIZE >= MAX_FILE_BLOCKS ) return -EFBIG;
 
-	bio_write(superblock_ptr->i_bitmap_blk, i_bitmap_buf);
-	bio_write(superblock_ptr->d_bitmap_blk, d_bitmap_buf);
-	
-	return 0;
-}
+	if ( (inode->flags & INODE_INLINE) && offset + len > INLINE_DATA_MAX ) {
+		retval = inline_spill(inode);
+		if ( retval != 0 ) return retval;
+	}
 
-static void *rufs_init(struct fuse_conn_info *conn) {
+	int last_block = (offset + len - 1) / BLOCK_SIZE;
+	if ( ! (inode->flags & INODE_INLINE) ) retval = file_extend(inode, last_block, last_block + 1);
 
-	if ( dev_open(diskfile_path) == -1 ) rufs_mkfs();
+	// Whatever was reserved before an error stays mapped, past st_size or not
+	if ( retval == 0 && ! (mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode->bytes ) {
+		inode->bytes = offset + len;
+		inode->mtime = time(NULL);
+	}
 
-	bio_read(SUPERBLOCK_BLKNO, superblock_buf);
-	bio_read(superblock_ptr->i_bitmap_blk, i_bitmap_buf);
-	bio_read(superblock_ptr->d_bitmap_blk, d_bitmap_buf);
+	inode->ctime = time(NULL);
+	idirty(inode);
 
-	return NULL;
+	return retval;
 }
 
-static void rufs_destroy(void *userdata) {
+// The cached inode of an open file, from its handle or else by path, to be handed back with fh_iput
+static struct inode *fh_iget(const char *path, struct fuse_file_info *fi, int *retval) {
 
-	dev_close();
+	if ( fi != NULL && fi->fh != 0 ) return ((struct file_handle *) (uintptr_t) fi->fh)->inode;
 
-}
+	struct inode inode;
+	*(retval) = get_node_by_path(path, ROOT_DIRECTORY_INO, &inode);
+	if ( *(retval) != 0 ) return NULL;
 
-static int rufs_getattr(const char *path, struct stat *stbuf) {
+	struct inode *cached = iget(inode.ino);
+	if ( cached == NULL ) *(retval) = -EIO;
 
-	struct inode temp;
-	int retval = get_node_by_path(path, ROOT_DIRECTORY_INO, &temp);
-	if ( retval == 0 ) {
-		*(stbuf) = temp.vstat;
-		return 0;
-	} else return retval;
-	
+	return cached;
 }
 
-static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
-
-	struct inode ino;
-	int retval = get_node_by_path(path, ROOT_DIRECTORY_INO, &ino);
-	if ( retval != 0 ) return retval;
-	else return 0;
-
+static void fh_iput(struct fuse_file_info *fi, struct inode *inode) {
+	if ( fi == NULL || fi->fh == 0 ) iput(inode);
 }
 
-static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+/*
+ * Blocks the first len bytes of fh's buffer could need when flushed: every
+ * block from the first one it touches, or the file's mapped end if that
+ * comes first, to its last, as blocks already mapped may be copied or
+ * recompressed, and the tables that map them.
+ */
+static int wb_need(struct file_handle *fh, size_t len) {
 
-	struct inode inode;
-	int retval = get_node_by_path(path, ROOT_DIRECTORY_INO, &inode);
-	if ( retval != 0 ) return retval;
-	if ( inode.type != IS_DIRECTORY ) return -ENOTDIR;
+	if ( len == 0 ) return 0;
+
+	int first = fh->wb_off / BLOCK_SIZE, last = (fh->wb_off + len - 1) / BLOCK_SIZE;
+	if ( (int) fh->inode->size < first ) first = fh->inode->size;
 
-	for ( int i = 0; i < inode.size; i++ ) {
+	int blocks = last + 1 - first;
 
-		bio_read(inode.direct_ptr[i], block_buf);
+	return blocks + blocks / PTRS_PER_BLOCK + 2;
+}
 
-		struct dirent *dirent_ptr = (struct dirent *) block_buf;
+// Writes out fh's buffered data, or only up to its last block (cluster, if compressed) boundary, with the inode lock held for writing
+static int wb_flush(struct file_handle *fh, int whole) {
 
-		for ( int j = 0; j < DIRENT_PER_BLOCK; j++ ) {
+	size_t unit = (fh->inode->flags & INODE_COMPRESS) ? CLUSTER_SIZE : BLOCK_SIZE;
 
-			if ( dirent_ptr[j].valid ) filler(buffer, dirent_ptr[j].name, NULL, 0);
+	size_t len = fh->wb_len;
+	if ( ! whole ) len = (fh->wb_off + fh->wb_len) / unit * unit - fh->wb_off;
 
-		}
+	if ( len > 0 ) {
+		block_draw = &fh->wb_resv;
+		int retval = file_write(fh->inode, (const char *) fh->wb_buf, len, fh->wb_off);
+		block_draw = NULL;
+		if ( retval < 0 ) return retval;
 
+		memmove(fh->wb_buf, fh->wb_buf + len, fh->wb_len - len);
+		fh->wb_off += len;
+		fh->wb_len -= len;
 	}
 
-	inode.vstat.st_atime = time(NULL);
+	// Only what the rest of the buffer could need stays reserved
+	int excess = fh->wb_resv - wb_need(fh, fh->wb_len);
+	if ( excess > 0 ) {
+		block_reserve(-excess);
+		fh->wb_resv -= excess;
+	}
 
-	writei(inode.ino, &inode);
+	// Any handle may flush, but only the one the inode's buffered data belongs to gives it up
+	if ( fh->wb_len == 0 && icache_of(fh->inode)->wb == fh ) {
+		icache_of(fh->inode)->wb = NULL;
+		// A buffer that grew is not kept at that size for a handle that may be done writing
+		if ( whole && fh->wb_size > WB_SIZE ) {
+			free(fh->wb_buf);
+			fh->wb_buf = NULL;
+			fh->wb_size = 0;
+		}
+	}
 
 	return 0;
 }
 
+// Flushes whichever handle has buffered data for inode, with its lock held for writing
+static int wb_sync(struct inode *inode) {
 
-static int rufs_mkdir(const char *path, mode_t mode) {
+	struct icache_entry *e = icache_of(inode);
 
-	char path_cpy1[strlen(path)], path_cpy2[strlen(path)];
-	strcpy(path_cpy1, path);
-	strcpy(path_cpy2, path);
+	return (e->wb != NULL) ? wb_flush(e->wb, 1) : 0;
+}
 
-	char *directory_path = dirname(path_cpy1);
-	char *directory_name = basename(path_cpy2);
+static int wb_write(struct file_handle *fh, const char *buffer, size_t size, off_t offset) {
 
-	struct inode parent_inode;
-	int retval = get_node_by_path(directory_path, ROOT_DIRECTORY_INO, &parent_inode);
-	if ( retval != 0 ) return retval;
-	if ( parent_inode.type != IS_DIRECTORY ) return -ENOTDIR;
+	struct inode *inode = fh->inode;
+	struct icache_entry *e = icache_of(inode);
+	int retval;
 
-	ino_t inode = get_avail_ino();
-	if ( inode == -1 ) return -ENOMEM;
+	if ( size == 0 ) return 0;
+	if ( (offset + size - 1) / BLOCK_SIZE >= MAX_FILE_BLOCKS ) return -EFBIG;
 
-	retval = dir_add(parent_inode, inode, directory_name, strlen(directory_name));
-	if ( retval != 0 ) return retval;
-	
-	struct inode base_inode;
-	readi(inode, &base_inode);
+	// Buffering only carries on for the same handle writing straight after its last write
+	if ( e->wb != NULL && (e->wb != fh || offset != fh->wb_off + fh->wb_len) ) {
+		retval = wb_flush(e->wb, 1);
+		if ( retval < 0 ) return retval;
+	}
 
-	base_inode.ino = inode;
-	
-	int blkno = get_avail_blkno();
-	if ( blkno == -1 ) return -ENOMEM;
+	// Data fh holds without owning the inode's buffer would otherwise be appended to at the wrong offset
+	if ( fh->wb_len > 0 && e->wb != fh ) {
+		retval = wb_flush(fh, 1);
+		if ( retval < 0 ) return retval;
+	}
 
-	bio_read(blkno, block_buf);
+	if ( fh->wb_len == 0 && size >= WB_MAX_SIZE ) return file_write(inode, buffer, size, offset);
 
-	struct dirent *dirent_ptr = (struct dirent *) block_buf;
+	if ( fh->wb_buf == NULL ) {
+		if ( (fh->wb_buf = malloc(WB_SIZE)) == NULL ) return file_write(inode, buffer, size, offset);
+		fh->wb_size = WB_SIZE;
+	}
 
-	dirent_ptr->ino = inode;
-	dirent_ptr->valid = VALID;
-	memcpy(dirent_ptr->name, cur_dir, 1);
-	dirent_ptr->len = 1;
-	dirent_ptr++;
+	for ( size_t done = 0; done < size; ) {
 
-	dirent_ptr->ino = parent_inode.ino;
-	dirent_ptr->valid = VALID;
-	memcpy(dirent_ptr->name, par_dir, 2);
-	dirent_ptr->len = 2;
+		if ( fh->wb_len == 0 ) {
+			fh->wb_off = offset + done;
+			fh->wb_bytes = inode->bytes;
+			e->wb = fh;
+		}
 
-	bio_write(blkno, block_buf);
+		size_t n = (size - done < fh->wb_size - fh->wb_len) ? size - done : fh->wb_size - fh->wb_len;
 
-	base_inode.direct_ptr[0] = blkno;
-	base_inode.size = 1;
-	base_inode.type = IS_DIRECTORY;
-	base_inode.valid = VALID;
-	base_inode.link = 2;
+		// Data whose blocks cannot be reserved is written through, where running out of space is reported
+		int need = wb_need(fh, fh->wb_len + n) - fh->wb_resv;
+		if ( need > 0 && block_reserve(need) != 0 ) {
+			retval = wb_flush(fh, 1);
+			if ( retval == 0 ) retval = file_write(inode, buffer + done, size - done, offset + done);
+			return (retval < 0) ? retval : (int) size;
+		}
+		if ( need > 0 ) fh->wb_resv += need;
+
+		memcpy(fh->wb_buf + fh->wb_len, buffer + done, n);
+		fh->wb_len += n;
+		done += n;
+
+		// A full buffer grows rather than being flushed while it can
+		if ( fh->wb_len == fh->wb_size && fh->wb_size < WB_MAX_SIZE ) {
+			unsigned char *grown = realloc(fh->wb_buf, fh->wb_size * 2);
+			if ( grown != NULL ) {
+				fh->wb_buf = grown;
+				fh->wb_size *= 2;
+			}
+		}
 
-	base_inode.vstat.st_atime = time(NULL);
-	base_inode.vstat.st_ctime = time(NULL);
-	base_inode.vstat.st_mtime = time(NULL);
-	base_inode.vstat.st_uid = getuid();
-	base_inode.vstat.st_gid = getgid();
-	base_inode.vstat.st_blksize = base_inode.size;
-	base_inode.vstat.st_blocks = base_inode.size;
-	base_inode.vstat.st_ino = base_inode.ino;
-	base_inode.vstat.st_mode = __S_IFDIR | mode;
-	base_inode.vstat.st_nlink = 2;
-	base_inode.vstat.st_size = sizeof(struct dirent) * 2;
+		if ( fh->wb_len == fh->wb_size ) {
+			retval = wb_flush(fh, 0);
+			if ( retval < 0 ) return retval;
+		}
+
+	}
 
-	writei(inode, &base_inode);
+	inode->atime = time(NULL);
+	inode->mtime = time(NULL);
+	if ( offset + size > inode->bytes ) inode->bytes = offset + size;
 
-	return 0;
+	idirty(inode);
+
+	return size;
 }
 
-static int rufs_rmdir(const char *path) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+static int rufs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+
+	int retval = 0;
+	struct inode *inode = fh_iget(path, fi, &retval);
+	if ( inode == NULL ) return retval;
+
+	ilock(inode->ino, 0);
+	inode_stat(inode, stbuf);
+	iunlock(inode->ino);
+
+	fh_iput(fi, inode);
+
 	return 0;
 }
 
-static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
-}
+// Tops up the prefetched blocks of a sequential reader, with the inode lock held
+static void fh_readahead(struct file_handle *fh, off_t offset, size_t size) {
 
-static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+	struct inode *inode = fh->inode;
 
-	char path_cpy1[strlen(path)], path_cpy2[strlen(path)];
-	strcpy(path_cpy1, path);
-	strcpy(path_cpy2, path);
+	if ( pthread_mutex_trylock(&fh->ra_lock) != 0 ) return;
 
-	char *directory_path = dirname(path_cpy1);
-	char *file_name = basename(path_cpy2);
+	if ( offset == fh->ra_next ) {
+		fh->ra_window = (fh->ra_window * 2 < RA_MIN_BLOCKS) ? RA_MIN_BLOCKS : fh->ra_window * 2;
+		if ( fh->ra_window > RA_MAX_BLOCKS ) fh->ra_window = RA_MAX_BLOCKS;
+	} else {
+		fh->ra_window = 0;
+		fh->ra_end = 0;
+	}
+	fh->ra_next = offset + size;
 
-	struct inode par_inode; 
-	int retval = get_node_by_path(directory_path, ROOT_DIRECTORY_INO, &par_inode);
-	if ( retval != 0 ) return retval;
+	int next = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int start = (fh->ra_end > next) ? fh->ra_end : next;
+	int end = next + fh->ra_window;
+	if ( end > (inode->bytes + BLOCK_SIZE - 1) / BLOCK_SIZE ) end = (inode->bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if ( end > inode->size ) end = inode->size;
 
-	ino_t ino_num = get_avail_ino();
-	if ( ino_num == -1 ) return -ENOMEM;
+	// Nothing is loaded until the reader is within half a window of the prefetched end
+	if ( start < end && fh->ra_end - next < fh->ra_window / 2 ) {
 
-	retval = dir_add(par_inode, ino_num, file_name, strlen(file_name));
-	if ( retval != 0 ) return retval;
+		int blknos[end - start];
 
-	struct inode file_inode;
+		if ( bmap(inode, start, end - start, blknos) == 0 ) {
 
-	file_inode.ino = ino_num;
-	file_inode.type = IS_FILE;
-	file_inode.valid = VALID;
-	file_inode.link = 1;
-	file_inode.size = 0;
+			for ( int i = 0, j; i < end - start; i = j ) {
+				for ( j = i + 1; j < end - start && blknos[j] == blknos[j - 1] + 1; j++ );
+				// Compressed clusters map holes and markers, and reserved blocks have nothing to load
+				if ( blknos[i] > 0 ) bio_readahead(blknos[i], j - i);
+			}
 
-	file_inode.vstat.st_atime = time(NULL);
-	file_inode.vstat.st_ctime = time(NULL);
-	file_inode.vstat.st_mtime = time(NULL);
-	file_inode.vstat.st_uid = getuid();
-	file_inode.vstat.st_gid = getgid();
-	file_inode.vstat.st_blksize = file_inode.size;
-	file_inode.vstat.st_blocks = file_inode.size;
-	file_inode.vstat.st_ino = file_inode.ino;
-	file_inode.vstat.st_mode = __S_IFREG | mode;
-	file_inode.vstat.st_nlink = 1;
-	file_inode.vstat.st_size = 0;
-	
-	writei(ino_num, &file_inode);
+			fh->ra_end = end;
 
-	return 0; 
-}
+		}
 
-static int rufs_open(const char *path, struct fuse_file_info *fi) {
+	}
 
-	struct inode open_inode;
-	int retval = get_node_by_path(path, ROOT_DIRECTORY_INO, &open_inode);
-	return retval;
+	pthread_mutex_unlock(&fh->ra_lock);
 
 }
 
 static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-	struct inode read_inode;
-	int retval = get_node_by_path(path, ROOT_DIRECTORY_INO, &read_inode);
-	if ( retval != 0 ) return retval;
-	if ( read_inode.type != IS_FILE ) return -EISDIR;
-
-	int blocks_to_read = (size + offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	if ( blocks_to_read > read_inode.size ) return -1;
-
-	int curr_block = offset / BLOCK_SIZE;
-	int bytes_read = 0;
+	int retval = 0;
+	struct inode *inode = fh_iget(path, fi, &retval);
+	if ( inode == NULL ) return retval;
 
-	while ( bytes_read < size ) {
+	if ( inode->type != IS_FILE ) retval = -EISDIR;
+	else {
+		ilock(inode->ino, 0);
 
-		int bytes_left_to_read = size - bytes_read;
-		int bytes_left_in_block = BLOCK_SIZE - (offset % BLOCK_SIZE);
-		int bytes_to_read_from_block = (bytes_left_to_read > bytes_left_in_block) ? bytes_left_in_block : bytes_left_to_read;
-		
-		bio_read(read_inode.direct_ptr[curr_block], block_buf);
-
-		void *read_ptr = block_buf + (offset % BLOCK_SIZE);
-		memcpy(buffer, read_ptr, bytes_to_read_from_block);
-		
-		bytes_read += bytes_to_read_from_block;
-		buffer += bytes_to_read_from_block;		
-		offset = 0;
-		curr_block++;
+		// Buffered writes have to reach the file first, which needs the write lock; the read is done under it too, as more could be buffered the moment it was dropped
+		if ( icache_of(inode)->wb != NULL ) {
+			iunlock(inode->ino);
+			ilock(inode->ino, 1);
+			retval = wb_sync(inode);
+		}
 
+		if ( retval == 0 ) retval = file_read(inode, buffer, size, offset);
+		if ( retval > 0 && fi != NULL && fi->fh != 0 ) fh_readahead((struct file_handle *) (uintptr_t) fi->fh, offset, retval);
+		iunlock(inode->ino);
 	}
 
-	read_inode.vstat.st_atime = time(NULL);
-	writei(read_inode.ino, &read_inode);
+	fh_iput(fi, inode);
 
-	return size;
+	return retval;
 
 }
 
 static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-	struct inode inode;
-	int retval = get_node_by_path(path, ROOT_DIRECTORY_INO, &inode);
-	if ( retval != 0 ) return retval;
-	if ( inode.type != IS_FILE ) return -EISDIR;
-
-	int blocks_for_write = (size + offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	if ( blocks_for_write > 16 ) return -EFBIG;
+	int retval = 0;
+	struct inode *inode = fh_iget(path, fi, &retval);
+	if ( inode == NULL ) return retval;
 
-	int blocks_to_allocate = blocks_for_write - inode.size;
+	if ( inode->type != IS_FILE ) retval = -EISDIR;
+	else {
+		ilock(inode->ino, 1);
+		if ( fi != NULL && fi->fh != 0 ) retval = wb_write((struct file_handle *) (uintptr_t) fi->fh, buffer, size, offset);
+		else if ( (retval = wb_sync(inode)) == 0 ) retval = file_write(inode, buffer, size, offset);
+		iunlock(inode->ino);
+	}
 
-	int curr_block = offset / BLOCK_SIZE;
-	int bytes_written = 0;
-	
-	while ( bytes_written < size ) {
+	fh_iput(fi, inode);
 
-		int bytes_left_to_write = size - bytes_written;
-		int bytes_left_in_block = BLOCK_SIZE - (offset % BLOCK_SIZE);
-		int bytes_to_write_from_block = (bytes_left_to_write > bytes_left_in_block) ? bytes_left_in_block : bytes_left_to_write;
+	return retval;
+}
 
-		if ( curr_block == inode.size ) {
+// Only RUFS_IOC_CLONE_RANGE, see rufs.h
+static int rufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
 
-			int allocated_block = get_avail_blkno();
-			bio_read(allocated_block, block_buf);
+	if ( (unsigned int) cmd != RUFS_IOC_CLONE_RANGE ) return -ENOTTY;
+	if ( flags & FUSE_IOCTL_COMPAT ) return -ENOSYS;
 
-			void *write_ptr = block_buf;
-			write_ptr += (offset % BLOCK_SIZE);
+	struct rufs_clone_range *range = data;
+	range->src_path[PATH_MAX - 1] = '\0';
 
-			memcpy(write_ptr, buffer, bytes_to_write_from_block);
+	struct inode src_inode;
+	int retval = get_node_by_path(range->src_path, ROOT_DIRECTORY_INO, &src_inode);
+	if ( retval != 0 ) return retval;
 
-			bio_write(allocated_block, block_buf);
+	struct inode *dest = fh_iget(path, fi, &retval);
+	if ( dest == NULL ) return retval;
 
-			inode.direct_ptr[inode.size++] = allocated_block;
+	struct inode *src = iget(src_inode.ino);
 
-		} else {
+	if ( src == NULL ) retval = -EIO;
+	else if ( src->type != IS_FILE || dest->type != IS_FILE ) retval = -EISDIR;
+	else if ( src->ino == dest->ino ) retval = -EINVAL;
+	else {
+		// In inode number order, so clones going both ways between two files cannot deadlock
+		ilock((src->ino < dest->ino) ? src->ino : dest->ino, 1);
+		ilock((src->ino < dest->ino) ? dest->ino : src->ino, 1);
 
-			bio_read(inode.direct_ptr[curr_block], block_buf);
+		retval = wb_sync(src);
+		if ( retval == 0 ) retval = wb_sync(dest);
+		if ( retval == 0 ) retval = file_clone(dest, src, range->src_offset, range->length, range->dest_offset);
 
-			void *write_ptr = block_buf;
-			write_ptr += (offset % BLOCK_SIZE);
+		iunlock(src->ino);
+		iunlock(dest->ino);
+	}
 
-			memcpy(write_ptr, buffer, bytes_to_write_from_block);
+	if ( src != NULL ) iput(src);
+	fh_iput(fi, dest);
 
-			bio_write(inode.direct_ptr[curr_block], block_buf);
+	return retval;
+}
 
-		}
+static int rufs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
 
-		bytes_written += bytes_to_write_from_block;
-		buffer += bytes_to_write_from_block;
-		offset = 0;
-		curr_block++;
+	int retval = 0;
+	struct inode *inode = fh_iget(path, fi, &retval);
+	if ( inode == NULL ) return retval;
 
+	if ( inode->type != IS_FILE ) retval = -EISDIR;
+	else {
+		ilock(inode->ino, 1);
+		if ( (retval = wb_sync(inode)) == 0 ) retval = file_fallocate(inode, mode, offset, length);
+		iunlock(inode->ino);
 	}
 
-	inode.vstat.st_atime = time(NULL);
-	inode.vstat.st_mtime = time(NULL);
-	inode.vstat.st_size += size;
-	inode.vstat.st_blksize += blocks_to_allocate;
-	inode.vstat.st_blocks += blocks_to_allocate;
-
-	writei(inode.ino, &inode);
+	fh_iput(fi, inode);
 
-	return size;
+	return retval;
 }
 
 static int rufs_unlink(const char *path) {
@@ -709,15 +2857,61 @@ static int rufs_truncate(const char *path, off_t size) {
 }
 
 static int rufs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+
+	struct file_handle *fh = (struct file_handle *) (uintptr_t) fi->fh;
+	if ( fh == NULL ) return 0;
+
+	ilock(fh->inode->ino, 1);
+	int retval = wb_flush(fh, 1);
+
+	// Whatever could not be written is dropped with the handle, and st_size goes back to cover only what was
+	if ( icache_of(fh->inode)->wb == fh ) {
+		icache_of(fh->inode)->wb = NULL;
+		if ( fh->inode->bytes > fh->wb_bytes ) {
+			fh->inode->bytes = ((uint64_t) fh->wb_off > fh->wb_bytes) ? (uint64_t) fh->wb_off : fh->wb_bytes;
+			idirty(fh->inode);
+		}
+	}
+
+	block_reserve(-fh->wb_resv);
+	fh->wb_resv = 0;
+	iunlock(fh->inode->ino);
+
+	iput(fh->inode);
+	pthread_mutex_destroy(&fh->ra_lock);
+	free(fh->wb_buf);
+	free(fh);
+	fi->fh = 0;
+
+	return retval;
 }
 
 static int rufs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+
+	struct file_handle *fh = (struct file_handle *) (uintptr_t) fi->fh;
+	if ( fh == NULL ) return 0;
+
+	ilock(fh->inode->ino, 1);
+	int retval = wb_flush(fh, 1);
+	iunlock(fh->inode->ino);
+
+	return retval;
+}
+
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+
+	if ( fi != NULL && fi->fh != 0 ) {
+		struct inode *inode = ((struct file_handle *) (uintptr_t) fi->fh)->inode;
+		ilock(inode->ino, 1);
+		int retval = wb_sync(inode);
+		iunlock(inode->ino);
+		if ( retval < 0 ) return retval;
+	}
+
+	if ( isync() != 0 ) return -EIO;
+	if ( bio_flush() < 0 ) return -EIO;
+	return 0;
+
 }
 
 static int rufs_utimens(const char *path, const struct timespec tv[2]) {
@@ -730,8 +2924,10 @@ static int rufs_utimens(const char *path, const struct timespec tv[2]) {
 static struct fuse_operations rufs_ope = {
 	.init		= rufs_init,
 	.destroy	= rufs_destroy,
+	.statfs		= rufs_statfs,
 
 	.getattr	= rufs_getattr,
+	.fgetattr	= rufs_fgetattr,
 	.readdir	= rufs_readdir,
 	.opendir	= rufs_opendir,
 	.releasedir	= rufs_releasedir,
@@ -746,8 +2942,11 @@ static struct fuse_operations rufs_ope = {
 
 	.truncate   = rufs_truncate,
 	.flush      = rufs_flush,
+	.fsync      = rufs_fsync,
 	.utimens    = rufs_utimens,
-	.release	= rufs_release
+	.release	= rufs_release,
+	.ioctl		= rufs_ioctl,
+	.fallocate	= rufs_fallocate
 };
 
 
@@ -757,7 +2956,12 @@ int main(int argc, char *argv[]) {
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
 
-	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if ( fuse_opt_parse(&args, &rufs_conf, rufs_opts, NULL) == -1 ) return 1;
+
+	fuse_stat = fuse_main(args.argc, args.argv, &rufs_ope, NULL);
+
+	fuse_opt_free_args(&args);
 
 	return fuse_stat;
 }
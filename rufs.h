@@ -8,59 +8,164 @@
 
 #include <linux/limits.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
+#define MAGIC_NUM 0x5C41
+#define SUPERBLOCK_BLKNO 0
+#define ROOT_DIRECTORY_INO 0
+
+#define IS_FILE 0
+#define IS_DIRECTORY 1
+
+#define INVALID 0
+#define VALID 1
+
+/* inode flags */
+#define INODE_INLINE 0x1			/* file data is in inline_data, no blocks mapped */
+#define INODE_COMPRESS 0x2			/* file data is mapped in clusters, see below */
+
+/*
+ * A compressed file maps its data in clusters of CLUSTER_BLOCKS logical
+ * blocks. A cluster that compressed well has CLUSTER_COMPRESSED in its
+ * first slot, then the blocks holding the compressed length (a uint32_t)
+ * and the compressed bytes, then 0 for the rest. Any other cluster maps
+ * its blocks as usual, with 0 standing for a block of zeros.
+ */
+#define CLUSTER_BLOCKS 16
+#define CLUSTER_COMPRESSED (-1)
+
+/* superblock flags */
+#define SB_CSUM_VALID 0x1			/* the checksum table matches the blocks, see block.c */
+
+/*
+ * RUFS_IOC_CLONE_RANGE, issued on an open file, maps its blocks from
+ * dest_offset to the blocks holding length bytes of src_path from
+ * src_offset, shared until either file writes them. The offsets are block
+ * aligned, and so is length unless the range runs to the end of the
+ * source, which length 0 also asks for. src_path is from the mount's root.
+ */
+struct rufs_clone_range {
+	uint64_t	src_offset;
+	uint64_t	length;
+	uint64_t	dest_offset;
+	char		src_path[PATH_MAX];
+};
+
+#define RUFS_IOC_CLONE_RANGE _IOW('r', 1, struct rufs_clone_range)
+
+/* geometry of a new image unless given at mount time */
+#define DEFAULT_DISK_SIZE (32 * 1024 * 1024)
+#define DEFAULT_BLOCKS_PER_INODE 8
 
 
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
+	uint32_t	max_inum;			/* maximum inode number */
+	uint32_t	max_dnum;			/* maximum data block number */
+	uint32_t	nblocks;			/* blocks in the image */
 	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	c_start_blk;		/* start block of checksum table */
+	uint32_t	r_start_blk;		/* start block of data block reference counts */
+	uint32_t	free_inodes;		/* clear bits in the inode bitmap */
+	uint32_t	free_blocks;		/* clear bits in the data block bitmap */
+	uint32_t	flags;
 };
 
+/*
+ * The on-disk inode, 128 bytes with every field at its natural alignment.
+ * A struct stat is built from it only when one is asked for.
+ */
 struct inode {
-	uint16_t	ino;				/* inode number */
-	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
-	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
-	struct stat	vstat;				/* inode stat */
+	uint32_t	ino;				/* inode number */
+	uint8_t		valid;				/* validity of the inode */
+	uint8_t		type;				/* type of the file */
+	uint16_t	mode;				/* file type and permission bits */
+	uint32_t	size;				/* logical blocks mapped */
+	uint16_t	link;				/* link count */
+	uint16_t	flags;				/* INODE_ flags */
+	uint32_t	holes;				/* mapped blocks with no data block behind them */
+	uint32_t	uid;				/* owner */
+	uint32_t	gid;				/* group */
+	uint32_t	atime;				/* access time, seconds since the epoch */
+	uint64_t	bytes;				/* size of the file in bytes */
+	uint32_t	mtime;				/* modification time */
+	uint32_t	ctime;				/* change time */
+	union {
+		struct {
+			int		direct_ptr[12];		/* direct pointer to data block */
+			int		indirect_ptr[8];	/* 0-6 single indirect, 7 double indirect */
+		};
+		unsigned char inline_data[80];	/* contents of a small file */
+	};
 };
 
+_Static_assert(sizeof(struct inode) == 128, "on-disk inode must stay 128 bytes");
+
+/*
+ * Directory entries are variable length and packed back to back. rec_len
+ * chains each record to the next, and the records of a block always add
+ * up to BLOCK_SIZE. A record with name_len 0 is free space; any record
+ * may carry slack after its name that a new entry can be carved from.
+ */
 struct dirent {
-	uint16_t ino;					/* inode number of the directory entry */
-	uint16_t valid;					/* validity of the directory entry */
-	char name[208];					/* name of the directory entry */
-	uint16_t len;					/* length of name */
+	uint32_t ino;					/* inode number of the directory entry */
+	uint16_t rec_len;				/* bytes from this record to the next */
+	uint8_t name_len;				/* length of name, 0 if the record is free */
+	uint8_t type;					/* IS_FILE or IS_DIRECTORY */
+	char name[];					/* name, not NUL terminated */
 };
 
+#define DIRENT_NAME_MAX 255
+#define DIRENT_REC_LEN(name_len) ((sizeof(struct dirent) + (name_len) + 3) & ~3)
+
+/*
+ * Directory index, block 0 of every directory. Entries are sorted by name
+ * hash; each names the dirent block holding the names whose hash is at
+ * least its own and below the next entry's.
+ */
+struct dx_entry {
+	uint32_t hash;					/* lowest name hash in the block */
+	uint32_t block;					/* logical block within the directory */
+};
+
+struct dx_root {
+	uint32_t count;					/* entries in use */
+	uint32_t reserved;
+	struct dx_entry entries[];
+};
+
+#define INODE_PER_BLOCK ((BLOCK_SIZE) / (sizeof(struct inode)))
+#define INLINE_DATA_MAX (sizeof(((struct inode *) 0)->inline_data))
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+/* the reference count table has a uint32_t per data block: its mappings beyond the first */
+#define REFS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+int rufs_format(const char *diskfile_path, int size_mb, int inodes, struct superblock *sb);
+void dir_init_leaf(void *block, uint32_t ino, uint32_t parent_ino);
+
 
 /*
  * bitmap operations
  */
 typedef unsigned char* bitmap_t;
 
-void set_bitmap(bitmap_t b, int i) {
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 